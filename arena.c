@@ -0,0 +1,198 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/*
+ * Smallest block ever allocated. This is enough for most shared objects, so
+ * the first file usually gets away with a single block.
+ */
+#define ARENA_MINBLOCK          (64 * 1024)
+
+struct _emablock_t {
+  emablock_t *next;
+  size_t size;                  /* Usable bytes in data */
+  size_t used;
+  union {                       /* Force ARENA_ALIGN alignment of data */
+    long double ld;
+    void *p;
+    unsigned long long ull;
+  } data[];
+};
+
+/*
+ * Start a new block of at least len bytes. Blocks grow geometrically so
+ * that a file that needs a lot of small pieces doesn't need a lot of blocks.
+ */
+static emablock_t *
+arena_block(emarena_t *a, size_t len)
+{
+  size_t sz = a->blocks ? 2 * a->blocks->size : ARENA_MINBLOCK;
+  emablock_t *b;
+
+  if (sz < len) {
+    sz = arena_round(len);
+  }
+
+  b = (emablock_t *)malloc(sizeof(emablock_t) + sz);
+  if (0 == b) {
+    abort();
+  }
+  b->size = sz;
+  b->used = 0;
+  b->next = a->blocks;
+  a->blocks = b;
+  a->nmalloc++;
+
+  return b;
+}
+
+void *
+arena_alloc(emarena_t *a, size_t len)
+{
+  emablock_t *b = a->blocks;
+  void *p;
+
+  len = arena_round(len);
+  if ((0 == b) || (b->size - b->used < len)) {
+    b = arena_block(a, len);
+  }
+
+  p = (char *)b->data + b->used;
+  b->used += len;
+
+  return p;
+}
+
+void *
+arena_calloc(emarena_t *a, size_t len)
+{
+  void *p = arena_alloc(a, len);
+
+  memset(p, 0, len);
+
+  return p;
+}
+
+/*
+ * The arena equivalent of realloc(). If old was the last thing allocated it
+ * is extended where it is when there is room, otherwise it is copied.
+ */
+void *
+arena_grow(emarena_t *a, void *old, size_t oldlen, size_t len)
+{
+  emablock_t *b = a->blocks;
+  void *p;
+
+  if (old && b && ((char *)old + arena_round(oldlen) == (char *)b->data + b->used) &&
+      (arena_round(len) - arena_round(oldlen) <= b->size - b->used)) {
+    b->used += arena_round(len) - arena_round(oldlen);
+    return old;
+  }
+
+  p = arena_alloc(a, len);
+  if (old) {
+    memcpy(p, old, oldlen);
+  }
+
+  return p;
+}
+
+char *
+arena_strdup(emarena_t *a, const char *str)
+{
+  size_t sl = strlen(str) + 1;
+
+  return (char *)memcpy(arena_alloc(a, sl), str, sl);
+}
+
+/*
+ * Make sure the next len bytes of allocations come from a single block,
+ * without any further calls to malloc().
+ */
+void
+arena_reserve(emarena_t *a, size_t len)
+{
+  if ((0 == a->blocks) || (a->blocks->size - a->blocks->used < len)) {
+    arena_block(a, len);
+  }
+}
+
+/*
+ * Give back everything allocated since the last reset. If that took more
+ * than one block they are replaced by a single one big enough for all of
+ * it. Returns the number of blocks allocated since the last reset.
+ */
+unsigned int
+arena_reset(emarena_t *a)
+{
+  emablock_t *b, *next;
+  size_t used = 0;
+  unsigned int nmalloc = a->nmalloc;
+
+  for (b = a->blocks; b; b = b->next) {
+    used += b->used;
+  }
+  if (used > a->peak) {
+    a->peak = used;
+  }
+
+  if (a->blocks && a->blocks->next) {
+    for (b = a->blocks; b; b = next) {
+      next = b->next;
+      free(b);
+    }
+    a->blocks = 0;
+    arena_block(a, a->peak);
+    nmalloc++;
+  } else if (a->blocks) {
+    a->blocks->used = 0;
+  }
+  a->nmalloc = 0;
+
+  return nmalloc;
+}
+
+void
+arena_free(emarena_t *a)
+{
+  emablock_t *b, *next;
+
+  for (b = a->blocks; b; b = next) {
+    next = b->next;
+    free(b);
+  }
+  a->blocks = 0;
+  a->nmalloc = 0;
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
@@ -0,0 +1,62 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef ELFMOD_ARENA_H
+#define ELFMOD_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * A bump allocator for the working memory of a single file. Everything is
+ * given back at once by arena_reset(), after which the arena keeps a single
+ * block big enough for the most any file has needed so far, so once it has
+ * seen a few files it stops calling malloc() at all. An all-zero emarena_t is
+ * an empty arena, ready for use.
+ */
+#define ARENA_ALIGN             16
+#define arena_round(n)          (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct _emablock_t emablock_t;
+
+typedef struct {
+  emablock_t *blocks;           /* Newest first; only the first is allocated from */
+  size_t peak;                  /* Most any one file has used */
+  unsigned int nmalloc;         /* Blocks allocated since the last reset */
+} emarena_t;
+
+extern void *arena_alloc(emarena_t *a, size_t len);
+extern void *arena_calloc(emarena_t *a, size_t len);
+extern void *arena_grow(emarena_t *a, void *old, size_t oldlen, size_t len);
+extern char *arena_strdup(emarena_t *a, const char *str);
+extern void arena_reserve(emarena_t *a, size_t len);
+extern unsigned int arena_reset(emarena_t *a);
+extern void arena_free(emarena_t *a);
+
+#endif /* ELFMOD_ARENA_H */
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
@@ -0,0 +1,305 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "elfmod.h"
+
+/*
+ * Number of files each worker thread may be ahead of the output. Files are
+ * written out strictly in the order they were submitted, so if one file takes
+ * a long time the others queue up behind it. This bounds how much buffered
+ * output can accumulate while that happens.
+ */
+#define BATCH_WINDOW_PER_THREAD 32
+
+#define SLOT_FREE               0       /* Slot is unused */
+#define SLOT_QUEUED             1       /* Waiting for, or being processed by, a worker */
+#define SLOT_DONE               2       /* Processed, output waiting to be written */
+
+typedef struct {
+  char *path;                   /* File to process */
+  int state;                    /* One of the SLOT_xxx values above */
+  int ret;                      /* Return value from process_path() */
+  char *obuf;                   /* Buffered stdout for this file */
+  size_t olen;
+  char *ebuf;                   /* Buffered stderr for this file */
+  size_t elen;
+} emslot_t;
+
+struct embatch {
+  const emopts_t *opts;
+  int nthreads;
+  int failed;                   /* A file returned an error, stop the run */
+  emctx_t ctx;                  /* Context used for serial runs */
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t work_cv;       /* Signalled when a file is queued or we are closing */
+  pthread_cond_t done_cv;       /* Signalled when a worker finishes a file */
+  emslot_t *slots;              /* Ring of window slots */
+  uint64_t window;
+  uint64_t next_submit;         /* Sequence number of the next submitted file */
+  uint64_t next_take;           /* Sequence number of the next file a worker takes */
+  uint64_t next_flush;          /* Sequence number of the next file to write out */
+  uint64_t stop_seq;            /* Earliest sequence number that failed */
+  int closing;
+};
+
+static void *
+batch_worker(void *arg)
+{
+  embatch_t *b = (embatch_t *)arg;
+  emctx_t ctx;
+  emslot_t *slot;
+  uint64_t seq;
+  int ret;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.opts = b->opts;
+
+  pthread_mutex_lock(&b->lock);
+  for (;;) {
+    while ((b->next_take == b->next_submit) && (0 == b->closing)) {
+      pthread_cond_wait(&b->work_cv, &b->lock);
+    }
+
+    if (b->next_take == b->next_submit) {
+      break;
+    }
+
+    seq = b->next_take++;
+    slot = &b->slots[seq % b->window];
+
+    /*
+     * If an earlier file has already failed the serial run would never have
+     * got as far as this one, so don't touch it at all. This is checked
+     * under the lock right before the file is processed; a file that was
+     * already under way when the failure came has its output written out by
+     * batch_finish(), so that nothing is changed without being reported.
+     */
+    if (seq > b->stop_seq) {
+      slot->ret = 0;
+      slot->state = SLOT_DONE;
+      pthread_cond_broadcast(&b->done_cv);
+      continue;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    ctx.out = open_memstream(&slot->obuf, &slot->olen);
+    ctx.err = open_memstream(&slot->ebuf, &slot->elen);
+    ret = process_path(&ctx, slot->path);
+    fclose(ctx.out);
+    fclose(ctx.err);
+
+    pthread_mutex_lock(&b->lock);
+    slot->ret = ret;
+    slot->state = SLOT_DONE;
+    if (ret && (seq < b->stop_seq)) {
+      b->stop_seq = seq;
+    }
+    pthread_cond_broadcast(&b->done_cv);
+  }
+  pthread_mutex_unlock(&b->lock);
+  ctx_release(&ctx);
+
+  return 0;
+}
+
+/*
+ * Write out the buffered output of every finished file at the head of the
+ * queue, in submission order. If wait is non-zero, keep going (waiting for
+ * the workers as needed) until everything submitted has been written. Must
+ * be called with the lock held. Only the submitting thread ever calls this.
+ */
+static void
+batch_flush(embatch_t *b, int wait)
+{
+  emslot_t *slot;
+
+  while ((0 == b->failed) && (b->next_flush < b->next_submit)) {
+    slot = &b->slots[b->next_flush % b->window];
+
+    if (slot->state != SLOT_DONE) {
+      if (0 == wait) {
+        return;
+      }
+      pthread_cond_wait(&b->done_cv, &b->lock);
+      continue;
+    }
+
+    /*
+     * Once a slot is done no worker will touch it again until we hand it
+     * back, so we can drop the lock while we write.
+     */
+    pthread_mutex_unlock(&b->lock);
+    fwrite(slot->obuf, 1, slot->olen, stdout);
+    fwrite(slot->ebuf, 1, slot->elen, stderr);
+    pthread_mutex_lock(&b->lock);
+
+    free(slot->obuf);
+    free(slot->ebuf);
+    free(slot->path);
+    if (slot->ret) {
+      b->failed = 1;
+    }
+    memset(slot, 0, sizeof(*slot));
+    b->next_flush++;
+  }
+}
+
+embatch_t *
+batch_new(const emopts_t *opts, int nthreads)
+{
+  embatch_t *b = (embatch_t *)calloc(1, sizeof(embatch_t));
+  int i;
+
+  b->opts = opts;
+  b->nthreads = nthreads;
+  b->ctx.opts = opts;
+  b->ctx.out = stdout;
+  b->ctx.err = stderr;
+
+  if (nthreads <= 1) {
+    return b;
+  }
+
+  b->window = (uint64_t)nthreads * BATCH_WINDOW_PER_THREAD;
+  b->slots = (emslot_t *)calloc(b->window, sizeof(emslot_t));
+  b->stop_seq = UINT64_MAX;
+  pthread_mutex_init(&b->lock, 0);
+  pthread_cond_init(&b->work_cv, 0);
+  pthread_cond_init(&b->done_cv, 0);
+
+  b->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+  for (i = 0; i < nthreads; i++) {
+    pthread_create(&b->threads[i], 0, batch_worker, b);
+  }
+
+  return b;
+}
+
+/*
+ * Queue a file for processing. For a serial run the file is processed right
+ * here. Returns non-zero once any file has failed in a way that should stop
+ * the run, after which the caller should stop submitting files.
+ */
+int
+batch_submit(embatch_t *b, const char *path)
+{
+  emslot_t *slot;
+  int ret;
+
+  if (b->failed) {
+    return 1;
+  }
+
+  if (0 == b->threads) {
+    b->failed = process_path(&b->ctx, path);
+    return b->failed;
+  }
+
+  pthread_mutex_lock(&b->lock);
+  batch_flush(b, 0);
+  while ((0 == b->failed) && (b->next_submit - b->next_flush >= b->window)) {
+    pthread_cond_wait(&b->done_cv, &b->lock);
+    batch_flush(b, 0);
+  }
+
+  if (0 == b->failed) {
+    slot = &b->slots[b->next_submit % b->window];
+    slot->path = strdup(path);
+    slot->state = SLOT_QUEUED;
+    b->next_submit++;
+    pthread_cond_signal(&b->work_cv);
+  }
+  ret = b->failed;
+  pthread_mutex_unlock(&b->lock);
+
+  return ret;
+}
+
+/*
+ * Wait for all submitted files to be processed and written out, then tear
+ * down the worker threads. Returns the exit status for the run.
+ */
+int
+batch_finish(embatch_t *b)
+{
+  uint64_t seq;
+  int i, ret;
+
+  if (b->threads) {
+    pthread_mutex_lock(&b->lock);
+    batch_flush(b, 1);
+    b->closing = 1;
+    pthread_cond_broadcast(&b->work_cv);
+    pthread_mutex_unlock(&b->lock);
+
+    for (i = 0; i < b->nthreads; i++) {
+      pthread_join(b->threads[i], 0);
+    }
+
+    /*
+     * Anything left over was queued behind a failed file. Most of it was
+     * never touched, but files that were being processed when the failure
+     * came may have been changed, so their output is still written, in
+     * order.
+     */
+    for (seq = b->next_flush; seq < b->next_submit; seq++) {
+      emslot_t *slot = &b->slots[seq % b->window];
+
+      if (slot->obuf) {
+        fwrite(slot->obuf, 1, slot->olen, stdout);
+      }
+      if (slot->ebuf) {
+        fwrite(slot->ebuf, 1, slot->elen, stderr);
+      }
+      free(slot->obuf);
+      free(slot->ebuf);
+      free(slot->path);
+    }
+
+    pthread_cond_destroy(&b->done_cv);
+    pthread_cond_destroy(&b->work_cv);
+    pthread_mutex_destroy(&b->lock);
+    free(b->threads);
+    free(b->slots);
+  }
+
+  ret = b->failed;
+  ctx_release(&b->ctx);
+  free(b);
+
+  return ret;
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
@@ -0,0 +1,412 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * statx() is only declared with _GNU_SOURCE, which we do not want to turn
+ * on for the rest of the program (it changes what fnmatch() does, amongst
+ * other things), so it lives here in file_id().
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+
+#include "elfmod.h"
+
+/*
+ * The cache file is a header followed by an open-addressed hash table of
+ * entries, keyed on device, inode and a hash of the options in effect. It
+ * is mapped read-only for the run, so lookups from any thread need no
+ * locking. Outcomes recorded during the run are kept on the side and merged
+ * into a new file, which replaces the old one, when the run finishes.
+ */
+#define CACHE_MAGIC             "ELFMODC1"
+#define CACHE_MIN_SLOTS         1024
+
+typedef struct {
+  char magic[8];
+  uint32_t entsize;             /* sizeof(emcent_t), guards against format changes */
+  uint32_t pad;
+  uint64_t nslots;              /* Always a power of 2 */
+  uint64_t nused;
+} emchdr_t;
+
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t opthash;             /* Zero marks an empty slot */
+  uint64_t size;
+  uint64_t mtime_ns;
+  uint32_t outcome;             /* CACHE_xxx below */
+  uint32_t pad;
+} emcent_t;
+
+static const char *cpath;
+static uint64_t opthash;
+static emchdr_t *chdr;          /* Mapped cache file */
+static size_t cmaplen;
+static emcent_t *cents;
+static int cskip;               /* Non-zero if recorded files can be skipped */
+
+static pthread_mutex_t ulock = PTHREAD_MUTEX_INITIALIZER;
+static emcent_t *updates;       /* Outcomes recorded this run */
+static size_t nupdates, updatesz;
+
+/*
+ * Get the identity of a file by name relative to dfd, or of the open file
+ * dfd itself if name is 0. Without full only the mode and size are filled
+ * in.
+ */
+int
+file_id(int dfd, const char *name, int flags, int full, emfid_t *id)
+{
+  struct statx stx;
+  unsigned int mask = STATX_TYPE | STATX_MODE | STATX_SIZE;
+
+  if (0 == name) {
+    name = "";
+    flags |= AT_EMPTY_PATH;
+  }
+
+  if (full) {
+    mask |= STATX_INO | STATX_MTIME;
+  }
+
+  if (emsys(statx(dfd, name, flags, mask, &stx)) < 0) {
+    return -1;
+  }
+
+  memset(id, 0, sizeof(*id));
+  id->size = stx.stx_size;
+  id->mode = stx.stx_mode;
+  if (full) {
+    id->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    id->ino = stx.stx_ino;
+    id->mtime_ns = (uint64_t)stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+  }
+
+  return 0;
+}
+
+static inline uint64_t
+fnv1a(uint64_t h, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+
+  while (len--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static uint64_t
+hash_str(uint64_t h, const char *str)
+{
+  if (str) {
+    h = fnv1a(h, str, strlen(str));
+  }
+  return fnv1a(h, "", 1);
+}
+
+static uint64_t
+hash_list(uint64_t h, const strlist_t *sl)
+{
+  int i;
+
+  for (i = 0; sl && (i < sl->strsz); i++) {
+    if (sl->strs[i]) {
+      h = hash_str(h, sl->strs[i]);
+    }
+  }
+  return fnv1a(h, "\1", 1);
+}
+
+/*
+ * Hash everything on the command line that affects what is done to a file.
+ * Any change to the options therefore invalidates every entry. The displays
+ * are left out, as files are never skipped when there is something to show.
+ */
+static uint64_t
+hash_opts(const emopts_t *opts)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  h = fnv1a(h, &opts->compliance, sizeof(opts->compliance));
+  if (opts->where) {
+    h = hash_str(h, opts->where);
+  }
+  h = hash_str(h, opts->interpreter);
+  h = hash_str(h, opts->soname);
+  h = hash_str(h, opts->rpath_set);
+  h = hash_str(h, opts->runpath_set);
+  h = hash_list(h, opts->abspath);
+  h = hash_list(h, opts->abs_nomatch);
+  h = hash_list(h, opts->abs_mustmatch);
+  h = hash_list(h, opts->needed_add);
+  h = hash_list(h, opts->needed_del);
+  h = hash_list(h, opts->rpath_add);
+  h = hash_list(h, opts->rpath_del);
+  h = hash_list(h, opts->runpath_add);
+  h = hash_list(h, opts->runpath_del);
+
+  return h ? h : 1;
+}
+
+static inline uint64_t
+slot_hash(uint64_t dev, uint64_t ino, uint64_t oh)
+{
+  uint64_t h = ino ^ (dev * 0x9e3779b97f4a7c15ULL) ^ oh;
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static emcent_t *
+slot_find(emcent_t *tab, uint64_t nslots, uint64_t dev, uint64_t ino, uint64_t oh)
+{
+  uint64_t mask = nslots - 1;
+  uint64_t i = slot_hash(dev, ino, oh) & mask;
+
+  while (tab[i].opthash) {
+    if ((tab[i].dev == dev) && (tab[i].ino == ino) && (tab[i].opthash == oh)) {
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+
+  return &tab[i];
+}
+
+/*
+ * Map the cache file, if there is a usable one. A missing or damaged cache
+ * file simply means everything is a miss.
+ */
+int
+cache_open(const emopts_t *opts)
+{
+  struct stat sb;
+  emchdr_t *h;
+  int fd;
+
+  cpath = opts->cachefile;
+  opthash = hash_opts(opts);
+
+  /*
+   * A skipped file produces no output, which is what is wanted from a run
+   * that only changes files but not from one that displays them as well.
+   * Such a run still records what it did, for later runs that only make
+   * the same changes.
+   */
+  cskip = (0 == opts->display_before) && (0 == opts->display_after);
+
+  fd = open(cpath, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    fprintf(stderr, "%s error: could not open cache `%s': %s\n", progname, cpath, strerror(errno));
+    return 1;
+  }
+
+  if ((fstat(fd, &sb) < 0) || ((size_t)sb.st_size < sizeof(emchdr_t))) {
+    close(fd);
+    return 0;
+  }
+
+  h = (emchdr_t *)mmap(0, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == h) {
+    return 0;
+  }
+
+  if (memcmp(h->magic, CACHE_MAGIC, 8) || (h->entsize != sizeof(emcent_t)) ||
+      (0 == h->nslots) || (h->nslots & (h->nslots - 1)) ||
+      ((size_t)sb.st_size != sizeof(emchdr_t) + h->nslots * sizeof(emcent_t))) {
+    fprintf(stderr, "%s warning: ignoring damaged cache `%s'\n", progname, cpath);
+    munmap(h, sb.st_size);
+    return 0;
+  }
+
+  chdr = h;
+  cmaplen = sb.st_size;
+  cents = (emcent_t *)(h + 1);
+
+  return 0;
+}
+
+/*
+ * Returns non-zero if the file is unchanged since an earlier run with the
+ * same options had nothing to do with it.
+ */
+int
+cache_lookup(const emfid_t *id)
+{
+  emcent_t *ce;
+
+  if ((0 == cents) || (0 == cskip)) {
+    return 0;
+  }
+
+  ce = slot_find(cents, chdr->nslots, id->dev, id->ino, opthash);
+  if ((0 == ce->opthash) || (ce->size != id->size) || (ce->mtime_ns != id->mtime_ns)) {
+    return 0;
+  }
+
+  emstat_add(cached, 1);
+  return ce->outcome;
+}
+
+/*
+ * Note the outcome (one of the CACHE_xxx values) for a file.
+ */
+void
+cache_record(const emfid_t *id, int outcome)
+{
+  emcent_t *ce;
+
+  if (0 == cpath) {
+    return;
+  }
+
+  pthread_mutex_lock(&ulock);
+  if (nupdates == updatesz) {
+    updatesz = updatesz ? updatesz * 2 : 256;
+    updates = (emcent_t *)realloc(updates, updatesz * sizeof(emcent_t));
+  }
+  ce = &updates[nupdates++];
+  memset(ce, 0, sizeof(*ce));
+  ce->dev = id->dev;
+  ce->ino = id->ino;
+  ce->opthash = opthash;
+  ce->size = id->size;
+  ce->mtime_ns = id->mtime_ns;
+  ce->outcome = outcome;
+  pthread_mutex_unlock(&ulock);
+}
+
+/*
+ * Merge the outcomes recorded during this run with the existing cache and
+ * atomically replace the cache file with the result.
+ */
+int
+cache_close(void)
+{
+  emchdr_t nh;
+  emcent_t *tab, *ce;
+  uint64_t nslots = CACHE_MIN_SLOTS, i, oldused = 0;
+  char *tmpname;
+  size_t tl;
+  FILE *fp;
+  int ok = 0, ret = 0;
+
+  if (0 == cpath) {
+    return 0;
+  }
+
+  if (chdr) {
+    oldused = chdr->nused;
+  }
+
+  if (0 == nupdates) {
+    goto out;
+  }
+
+  while (nslots < 2 * (oldused + nupdates)) {
+    nslots *= 2;
+  }
+
+  tab = (emcent_t *)calloc(nslots, sizeof(emcent_t));
+  memset(&nh, 0, sizeof(nh));
+  memcpy(nh.magic, CACHE_MAGIC, 8);
+  nh.entsize = sizeof(emcent_t);
+  nh.nslots = nslots;
+
+  for (i = 0; cents && (i < chdr->nslots); i++) {
+    if (cents[i].opthash) {
+      ce = slot_find(tab, nslots, cents[i].dev, cents[i].ino, cents[i].opthash);
+      *ce = cents[i];
+      nh.nused++;
+    }
+  }
+
+  for (i = 0; i < nupdates; i++) {
+    ce = slot_find(tab, nslots, updates[i].dev, updates[i].ino, updates[i].opthash);
+    if (0 == ce->opthash) {
+      nh.nused++;
+    }
+    *ce = updates[i];
+  }
+
+  tl = strlen(cpath) + 16;
+  tmpname = (char *)malloc(tl);
+  snprintf(tmpname, tl, "%s.%ld", cpath, (long)getpid());
+
+  fp = fopen(tmpname, "w");
+  if (fp) {
+    ok = (fwrite(&nh, sizeof(nh), 1, fp) == 1) && (fwrite(tab, sizeof(emcent_t), nslots, fp) == nslots);
+    if (fclose(fp)) {
+      ok = 0;
+    }
+  }
+
+  if ((0 == ok) || rename(tmpname, cpath)) {
+    fprintf(stderr, "%s error: could not write cache `%s': %s\n", progname, cpath, strerror(errno));
+    unlink(tmpname);
+    ret = 1;
+  }
+
+  free(tmpname);
+  free(tab);
+
+out:
+  if (chdr) {
+    munmap(chdr, cmaplen);
+    chdr = 0;
+    cents = 0;
+  }
+  free(updates);
+  updates = 0;
+  nupdates = updatesz = 0;
+
+  return ret;
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
@@ -0,0 +1,262 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "elfmod.h"
+
+/*
+ * make_absolute() wants to know, for every needed library in every file,
+ * whether a library of that name exists in each of the =a directories. In a
+ * large batch that is the same handful of questions asked over and over, so
+ * instead each directory is read once, up front, and every name in it goes
+ * into a single hash set keyed on the directory's position in the =a list
+ * and the name. After that every question is answered from memory.
+ *
+ * A name that is a symbolic link (or whose type the filesystem doesn't tell
+ * us) might not resolve to anything, which stat() would have caught. Those
+ * are checked with fstatat() the first time they are asked about, and the
+ * answer kept.
+ */
+#define DC_MIN_SLOTS            1024
+#define DC_DENTBUF              32768
+
+#define DC_UNKNOWN              0       /* Not yet checked */
+#define DC_EXISTS               1
+#define DC_MISSING              2
+
+typedef struct {
+  char *name;                   /* 0 marks an empty slot */
+  uint32_t hash;
+  uint32_t dir;                 /* Index into the =a list */
+  int state;                    /* DC_xxx above */
+} dcent_t;
+
+static dcent_t *dc_ents;
+static size_t dc_nslots;
+static size_t dc_nused;
+static int *dc_dirfds;          /* Kept open for the fstatat() above */
+static char **dc_dests;         /* Destination part of each =a path */
+static int dc_ndirs;
+
+static uint32_t
+dc_hash(uint32_t dir, const char *name)
+{
+  uint32_t h = 2166136261U ^ dir;
+
+  while (*name) {
+    h ^= (unsigned char)*name++;
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+static void
+dc_insert(dcent_t *ents, size_t nslots, const dcent_t *ent)
+{
+  size_t i = ent->hash & (nslots - 1);
+
+  while (ents[i].name) {
+    i = (i + 1) & (nslots - 1);
+  }
+  ents[i] = *ent;
+}
+
+static void
+dc_add(uint32_t dir, const char *name, int state)
+{
+  dcent_t ent;
+  size_t i;
+
+  if (2 * (dc_nused + 1) > dc_nslots) {
+    size_t nslots = dc_nslots ? 2 * dc_nslots : DC_MIN_SLOTS;
+    dcent_t *ents = (dcent_t *)calloc(nslots, sizeof(dcent_t));
+
+    for (i = 0; i < dc_nslots; i++) {
+      if (dc_ents[i].name) {
+        dc_insert(ents, nslots, &dc_ents[i]);
+      }
+    }
+    free(dc_ents);
+    dc_ents = ents;
+    dc_nslots = nslots;
+  }
+
+  ent.name = strdup(name);
+  ent.hash = dc_hash(dir, name);
+  ent.dir = dir;
+  ent.state = state;
+  dc_insert(dc_ents, dc_nslots, &ent);
+  dc_nused++;
+}
+
+/*
+ * Read one directory into the set.
+ */
+static void
+dc_read(uint32_t dir, int dfd)
+{
+  char *buf = (char *)malloc(DC_DENTBUF);
+  struct linux_dirent64 *de;
+  long nread, bpos;
+
+  while ((nread = syscall(SYS_getdents64, dfd, buf, DC_DENTBUF)) > 0) {
+    for (bpos = 0; bpos < nread; bpos += de->d_reclen) {
+      de = (struct linux_dirent64 *)(buf + bpos);
+
+      if ((de->d_name[0] == '.') && ((de->d_name[1] == 0) || ((de->d_name[1] == '.') && (de->d_name[2] == 0)))) {
+        continue;
+      }
+
+      dc_add(dir, de->d_name, ((DT_LNK == de->d_type) || (DT_UNKNOWN == de->d_type)) ? DC_UNKNOWN : DC_EXISTS);
+    }
+  }
+
+  free(buf);
+}
+
+void
+dircache_open(const strlist_t *abspath)
+{
+  char *dir, *s;
+  int i, dfd;
+
+  dc_ndirs = abspath->strsz;
+  dc_dirfds = (int *)malloc((dc_ndirs ? dc_ndirs : 1) * sizeof(int));
+  dc_dests = (char **)calloc(dc_ndirs ? dc_ndirs : 1, sizeof(char *));
+
+  for (i = 0; i < dc_ndirs; i++) {
+    dc_dirfds[i] = -1;
+    if (0 == abspath->strs[i]) {
+      continue;
+    }
+
+    /*
+     * A "stage:dest" path is looked for in stage/dest but names dest. See
+     * the description of =a in display_usage().
+     */
+    dir = (char *)malloc(strlen(abspath->strs[i]) + 1);
+    s = strchr(abspath->strs[i], ':');
+    if (s) {
+      memcpy(dir, abspath->strs[i], s - abspath->strs[i]);
+      strcpy(dir + (s - abspath->strs[i]), s + 1);
+      dc_dests[i] = strdup(s + 1);
+    } else {
+      strcpy(dir, abspath->strs[i]);
+      dc_dests[i] = strdup(dir);
+    }
+
+    /*
+     * A directory we can't read simply has nothing in it, just as every
+     * stat() in it would have failed.
+     */
+    dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0) {
+      dc_read(i, dfd);
+      dc_dirfds[i] = dfd;
+    }
+    free(dir);
+  }
+}
+
+const char *
+dircache_lookup(int dir, const char *name)
+{
+  uint32_t h;
+  size_t i;
+  int state;
+  struct stat sb;
+
+  if (0 == dc_nslots) {
+    emstat_add(abs_misses, 1);
+    return 0;
+  }
+
+  h = dc_hash(dir, name);
+  for (i = h & (dc_nslots - 1); dc_ents[i].name; i = (i + 1) & (dc_nslots - 1)) {
+    dcent_t *ent = &dc_ents[i];
+
+    if ((ent->hash != h) || (ent->dir != (uint32_t)dir) || strcmp(ent->name, name)) {
+      continue;
+    }
+
+    state = __atomic_load_n(&ent->state, __ATOMIC_RELAXED);
+    if (DC_UNKNOWN == state) {
+      state = fstatat(dc_dirfds[dir], name, &sb, 0) ? DC_MISSING : DC_EXISTS;
+      __atomic_store_n(&ent->state, state, __ATOMIC_RELAXED);
+    }
+
+    if (DC_EXISTS == state) {
+      emstat_add(abs_hits, 1);
+      return dc_dests[dir];
+    }
+    break;
+  }
+
+  emstat_add(abs_misses, 1);
+  return 0;
+}
+
+void
+dircache_close(void)
+{
+  size_t i;
+  int d;
+
+  for (i = 0; i < dc_nslots; i++) {
+    free(dc_ents[i].name);
+  }
+  free(dc_ents);
+  dc_ents = 0;
+  dc_nslots = dc_nused = 0;
+
+  for (d = 0; d < dc_ndirs; d++) {
+    if (dc_dirfds[d] >= 0) {
+      close(dc_dirfds[d]);
+    }
+    free(dc_dests[d]);
+  }
+  free(dc_dests);
+  free(dc_dirfds);
+  dc_dests = 0;
+  dc_dirfds = 0;
+  dc_ndirs = 0;
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
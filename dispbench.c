@@ -0,0 +1,358 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Times the -D display of a file with a very large section header table,
+ * which is where the formatting cost of the header displays shows up. It
+ * writes a 64-bit shared object of the native byte order with the given
+ * number of sections, each one 16 bytes of a single loadable segment, and
+ * then runs elfmod -D on it several times, with the output going to
+ * /dev/null so that only the formatting is timed, and reports the best time.
+ * Given a second elfmod (an older build, say) it times that too and checks
+ * that the two print exactly the same thing. With -o it only writes the file.
+ * "make bench" runs it against the elfmod just built.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "elf.h"
+
+#define DB_SECTIONS             100000
+#define DB_RUNS                 5
+#define DB_FIXED                4       /* Null, .dynstr, .dynamic, .shstrtab */
+
+static const char db_dynstr[] = "\0libc.so.6\0libdispbench.so";
+static const char db_shstr[] = "\0.dynstr\0.dynamic\0.shstrtab";
+
+static size_t
+db_align(size_t off, size_t align)
+{
+  return (off + align - 1) & ~(align - 1);
+}
+
+/*
+ * Build the whole file in memory and write it out.
+ */
+static int
+db_write(const char *fname, unsigned long nsects)
+{
+  unsigned long nsh = nsects + DB_FIXED, i;
+  size_t dynstroff, dynoff, dataoff, shstroff, shstrsz, shoff, flen, np;
+  union { uint16_t u; unsigned char c[2]; } order;
+  unsigned char *buf;
+  Elf64_Ehdr *eh;
+  Elf64_Phdr *ph;
+  Elf64_Shdr *sh;
+  Elf64_Dyn *dyn;
+  char *names;
+  FILE *fp;
+
+  dynstroff = sizeof(Elf64_Ehdr) + 2 * sizeof(Elf64_Phdr);
+  dynoff = db_align(dynstroff + sizeof(db_dynstr), 8);
+  dataoff = db_align(dynoff + 5 * sizeof(Elf64_Dyn), 16);
+  shstroff = dataoff + nsects * 16;
+  shstrsz = sizeof(db_shstr);
+  for (i = 0; i < nsects; i++) {
+    shstrsz += (size_t)snprintf(0, 0, ".data.%lu", i) + 1;
+  }
+  shoff = db_align(shstroff + shstrsz, 8);
+  flen = shoff + nsh * sizeof(Elf64_Shdr);
+
+  buf = (unsigned char *)calloc(1, flen);
+  if (0 == buf) {
+    fprintf(stderr, "dispbench: out of memory\n");
+    return 1;
+  }
+
+  order.u = 1;
+  eh = (Elf64_Ehdr *)buf;
+  memcpy(eh->e_ident, ELFMAG, SELFMAG);
+  eh->e_ident[EI_CLASS] = ELFCLASS64;
+  eh->e_ident[EI_DATA] = order.c[0] ? ELFDATA2LSB : ELFDATA2MSB;
+  eh->e_ident[EI_VERSION] = EV_CURRENT;
+  eh->e_type = ET_DYN;
+  eh->e_machine = EM_X86_64;
+  eh->e_version = EV_CURRENT;
+  eh->e_phoff = sizeof(Elf64_Ehdr);
+  eh->e_shoff = shoff;
+  eh->e_ehsize = sizeof(Elf64_Ehdr);
+  eh->e_phentsize = sizeof(Elf64_Phdr);
+  eh->e_phnum = 2;
+  eh->e_shentsize = sizeof(Elf64_Shdr);
+  eh->e_shnum = (nsh < SHN_LORESERVE) ? nsh : 0;
+  eh->e_shstrndx = 3;
+
+  ph = (Elf64_Phdr *)(buf + eh->e_phoff);
+  ph[0].p_type = PT_LOAD;
+  ph[0].p_flags = PF_R | PF_W;
+  ph[0].p_filesz = ph[0].p_memsz = shstroff;
+  ph[0].p_align = 4096;
+  ph[1].p_type = PT_DYNAMIC;
+  ph[1].p_flags = PF_R | PF_W;
+  ph[1].p_offset = ph[1].p_vaddr = ph[1].p_paddr = dynoff;
+  ph[1].p_filesz = ph[1].p_memsz = 5 * sizeof(Elf64_Dyn);
+  ph[1].p_align = 8;
+
+  memcpy(buf + dynstroff, db_dynstr, sizeof(db_dynstr));
+  dyn = (Elf64_Dyn *)(buf + dynoff);
+  dyn[0].d_tag = DT_NEEDED;
+  dyn[0].d_un.d_val = 1;
+  dyn[1].d_tag = DT_SONAME;
+  dyn[1].d_un.d_val = 11;
+  dyn[2].d_tag = DT_STRTAB;
+  dyn[2].d_un.d_ptr = dynstroff;
+  dyn[3].d_tag = DT_STRSZ;
+  dyn[3].d_un.d_val = sizeof(db_dynstr);
+  dyn[4].d_tag = DT_NULL;
+
+  names = (char *)buf + shstroff;
+  memcpy(names, db_shstr, sizeof(db_shstr));
+
+  sh = (Elf64_Shdr *)(buf + shoff);
+  if (0 == eh->e_shnum) {
+    sh[0].sh_size = nsh;
+  }
+  sh[1].sh_name = 1;
+  sh[1].sh_type = SHT_STRTAB;
+  sh[1].sh_flags = SHF_ALLOC;
+  sh[1].sh_addr = sh[1].sh_offset = dynstroff;
+  sh[1].sh_size = sizeof(db_dynstr);
+  sh[1].sh_addralign = 1;
+  sh[2].sh_name = 9;
+  sh[2].sh_type = SHT_DYNAMIC;
+  sh[2].sh_flags = SHF_ALLOC | SHF_WRITE;
+  sh[2].sh_addr = sh[2].sh_offset = dynoff;
+  sh[2].sh_size = 5 * sizeof(Elf64_Dyn);
+  sh[2].sh_link = 1;
+  sh[2].sh_addralign = 8;
+  sh[2].sh_entsize = sizeof(Elf64_Dyn);
+  sh[3].sh_name = 18;
+  sh[3].sh_type = SHT_STRTAB;
+  sh[3].sh_offset = shstroff;
+  sh[3].sh_size = shstrsz;
+  sh[3].sh_addralign = 1;
+
+  np = sizeof(db_shstr);
+  for (i = 0; i < nsects; i++) {
+    Elf64_Shdr *s = &sh[DB_FIXED + i];
+
+    s->sh_name = np;
+    s->sh_type = SHT_PROGBITS;
+    s->sh_flags = SHF_ALLOC | SHF_WRITE;
+    s->sh_addr = s->sh_offset = dataoff + i * 16;
+    s->sh_size = 16;
+    s->sh_addralign = 16;
+    np += (size_t)sprintf(names + np, ".data.%lu", i) + 1;
+  }
+
+  fp = fopen(fname, "wb");
+  if ((0 == fp) || (fwrite(buf, 1, flen, fp) != flen) || fclose(fp)) {
+    fprintf(stderr, "dispbench: could not write `%s': %s\n", fname, strerror(errno));
+    free(buf);
+    return 1;
+  }
+
+  free(buf);
+  return 0;
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run "prog -D fname" with its output going to outname, and return how long
+ * it took, or a negative number if it failed.
+ */
+static double
+db_run(const char *prog, const char *fname, const char *outname)
+{
+  double t0 = now();
+  pid_t pid;
+  int status, fd;
+
+  pid = fork();
+  if (0 == pid) {
+    fd = open(outname, O_WRONLY | O_TRUNC);
+    if ((fd < 0) || (dup2(fd, 1) < 0)) {
+      _exit(127);
+    }
+    execl(prog, prog, "-D", fname, (char *)0);
+    _exit(127);
+  }
+
+  if ((pid < 0) || (waitpid(pid, &status, 0) < 0) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "dispbench: `%s -D %s' failed\n", prog, fname);
+    return -1;
+  }
+
+  return now() - t0;
+}
+
+/*
+ * Time runs of prog, reporting the best of them, then run it once more to
+ * keep its output in outname.
+ */
+static double
+db_time(const char *prog, const char *fname, const char *outname, int runs)
+{
+  double t, best = -1;
+  struct stat sb;
+  int i;
+
+  for (i = 0; i < runs; i++) {
+    t = db_run(prog, fname, "/dev/null");
+    if (t < 0) {
+      return t;
+    }
+    if ((best < 0) || (t < best)) {
+      best = t;
+    }
+  }
+
+  if ((db_run(prog, fname, outname) < 0) || (stat(outname, &sb) < 0)) {
+    return -1;
+  }
+  printf("%-30s %8.1f ms  %10lld bytes  %7.1f MB/s\n", prog, best * 1e3, (long long)sb.st_size, sb.st_size / best / 1e6);
+
+  return best;
+}
+
+/*
+ * Compare two files byte for byte.
+ */
+static int
+db_same(const char *a, const char *b)
+{
+  FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+  int ca = 0, cb = 0;
+
+  if (fa && fb) {
+    do {
+      ca = getc(fa);
+      cb = getc(fb);
+    } while ((ca == cb) && (EOF != ca));
+  }
+  if (fa) {
+    fclose(fa);
+  }
+  if (fb) {
+    fclose(fb);
+  }
+
+  return fa && fb && (ca == cb);
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: dispbench [-n sections] -o file\n"
+      "       dispbench [-n sections] [-r runs] elfmod [reference-elfmod]\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  unsigned long nsects = DB_SECTIONS;
+  const char *outfile = 0;
+  char fname[] = "/tmp/dispbenchXXXXXX";
+  char out1[] = "/tmp/dispbenchXXXXXX";
+  char out2[] = "/tmp/dispbenchXXXXXX";
+  int opt, runs = DB_RUNS, ret = 1;
+
+  while ((opt = getopt(argc, argv, "n:r:o:")) != -1) {
+    switch (opt) {
+      case 'n':
+        nsects = strtoul(optarg, 0, 0);
+        break;
+      case 'r':
+        runs = atoi(optarg);
+        break;
+      case 'o':
+        outfile = optarg;
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if ((runs < 1) || (outfile ? (optind != argc) : ((optind == argc) || (argc - optind > 2)))) {
+    usage();
+    return 1;
+  }
+
+  if (outfile) {
+    return db_write(outfile, nsects);
+  }
+
+  if ((mkstemp(fname) < 0) || (mkstemp(out1) < 0) || (mkstemp(out2) < 0)) {
+    fprintf(stderr, "dispbench: could not make temporary files: %s\n", strerror(errno));
+    return 1;
+  }
+
+  if (0 == db_write(fname, nsects)) {
+    printf("-D of a file with %lu sections, best of %d runs:\n", nsects + DB_FIXED, runs);
+    if (db_time(argv[optind], fname, out1, runs) >= 0) {
+      ret = 0;
+      if (argc - optind == 2) {
+        if (db_time(argv[optind + 1], fname, out2, runs) < 0) {
+          ret = 1;
+        } else if (db_same(out1, out2)) {
+          printf("Output is identical.\n");
+        } else {
+          printf("Output differs.\n");
+          ret = 1;
+        }
+      }
+    }
+  }
+
+  unlink(fname);
+  unlink(out1);
+  unlink(out2);
+
+  return ret;
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
@@ -32,21 +32,33 @@
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 #include <fnmatch.h>
 
 #include "elfmod.h"
+#include "record.h"
 
 static const char *const version = "1.0";
 static const char *const github_url = "https://github.com/jkj/elfmod";
 static const char *const copyright = "(C) Copyright 2016-2022 Kean Johnston. All rights reserved.";
 
 const char *progname = 0;
-const char *curfile = 0;
-static int host_byteorder = 0;
-
-uint32_t emdisplay_before = 0;
-uint32_t emdisplay_after = 0;
+emstats_t emstats;
+
+static const char *const reject_names[REJ_NUM] = {
+  "not a regular file",
+  "not ELF",
+  "unknown byte order",
+  "truncated headers",
+  "not an executable or shared object",
+  "no program headers",
+  "executable without interpreter",
+  "no PT_DYNAMIC segment",
+  "no DT_STRTAB",
+  "no DT_STRSZ",
+  "no dynamic string table",
+  "no dynamic section",
+  "not selected by -W",
+};
 
 static void
 display_usage(FILE *where)
@@ -144,6 +156,14 @@ display_usage(FILE *where)
       "  section data the flags field uses the following:\n"
       "   a=allocated w=writeable x=executable m=merge s=strings i=info l=link order\n"
       "   o=OS specific g=group t=TLS c=compressed O=ordered e=exclude\n"
+      "\n"
+      "-o format\n"
+      "  Write the output of the display options above in another format, as one\n"
+      "  record for each file displayed. The format is text (the default), jsonl\n"
+      "  for one JSON object per line, or cbor for a sequence of CBOR maps. Records\n"
+      "  have a key for each display option given: interp, soname, needed, rpath,\n"
+      "  runpath, flags (and flags_1), dynamic, and for -D, header, segments and\n"
+      "  sections. Records made by + options have an after key set to true.\n"
       "\n");
 
   fprintf(where,
@@ -192,128 +212,520 @@ display_usage(FILE *where)
       "  manual pages for details.\n"
       "\n");
 
+  fprintf(where,
+      "-j threads\n"
+      "  Process files on the specified number of threads. A value of 0 uses one\n"
+      "  thread per online CPU. The output of each file is buffered and written in\n"
+      "  the order the files were given, so it is identical to that of a serial run.\n"
+      "\n");
+
+  fprintf(where,
+      "-@ listfile / -0\n"
+      "  Also process the files named in listfile, one per line, or use - to read\n"
+      "  the names from standard input. Names are processed as they are read, so\n"
+      "  there is no limit on how many can be given. With -0 the names are separated\n"
+      "  by NUL characters instead of newlines, as produced by find -print0.\n"
+      "\n");
+
+  fprintf(where,
+      "-T directory\n"
+      "  Process every ELF file found anywhere below the directory. Files that are\n"
+      "  not ELF files are silently skipped and symbolic links are not followed.\n"
+      "  Can be used multiple times, and along with file names. With -j the tree is\n"
+      "  walked by all threads, and files are reported in the order they are found.\n"
+      "\n");
+
+  fprintf(where,
+      "-W predicate\n"
+      "  Only work on files whose dynamic section matches the predicate, such as\n"
+      "  'needed ~ \"libfoo*\" && !runpath'. Other files are skipped. With no other\n"
+      "  options that display or change files, the name of each file that matches\n"
+      "  is listed, and nothing else is done to it. A test is a field (interp,\n"
+      "  soname, needed, rpath, runpath or flags), true if the file has one, or a\n"
+      "  field compared with a value using == (equal), != (not equal), ~ (matches\n"
+      "  the shell pattern) or !~ (does not). needed and flags can have several\n"
+      "  values, any of which can match. The values of flags are the names -F\n"
+      "  shows (ORIGIN, SYMBOLIC, TEXTREL, BIND_NOW, STATIC_TLS). Tests are\n"
+      "  combined with !, && and ||, and grouped with ( and ). Values containing\n"
+      "  spaces or operators go in double quotes. The predicate is compiled once,\n"
+      "  before any file is opened.\n"
+      "\n");
+
+  fprintf(where,
+      "-C cachefile\n"
+      "  Keep a record in cachefile of every file that was processed or found not to\n"
+      "  be a file this program works on. Later runs with exactly the same options\n"
+      "  skip such files, producing no output for them, unless their size or\n"
+      "  modification time has changed. Files that could not be read are never\n"
+      "  recorded. Only for use with options that change files; if the run also\n"
+      "  displays anything, every file is still processed so that it is shown.\n"
+      "\n");
+
+  fprintf(where,
+      "-X indexfile\n"
+      "  Keep an index in indexfile of what -A would show for every file processed:\n"
+      "  its interpreter, soname, rpath, runpath, flags and needed libraries. The\n"
+      "  index is rebuilt from the files given on each run, but files it already\n"
+      "  holds are not opened again unless their size or modification time has\n"
+      "  changed. Files not given are dropped from it. Cannot be used with -C or\n"
+      "  with options that change files.\n"
+      "\n");
+
+  fprintf(where,
+      "-Q query\n"
+      "  Answer a query from the index given with -X, without opening any ELF file,\n"
+      "  by listing the path of every file in it that matches. No files are\n"
+      "  processed. The query is needed, soname, rpath, runpath or interp, each\n"
+      "  optionally followed by =value, or origin. With a value only files with\n"
+      "  exactly that entry match (needed=libfoo.so.1 lists everything that needs\n"
+      "  libfoo.so.1), without one every file with such an entry does. origin\n"
+      "  matches files that use $ORIGIN.\n"
+      "\n");
+
+  fprintf(where,
+      "-M bytes\n"
+      "  Read files of up to this many bytes (64K by default) into memory in one go,\n"
+      "  rather than mapping the parts of them that are needed. For small files\n"
+      "  that is cheaper. Use 0 to map every file. With -v the number of files\n"
+      "  read and the amount mapped for the rest are shown.\n"
+      "\n");
+
+  fprintf(where,
+      "-v\n"
+      "  When all files have been processed, display statistics about the run on\n"
+      "  standard error, including how many files were skipped and why.\n"
+      "\n");
+
   fprintf(where,
       "-V\n"
       "  Display the version number and exit.\n"
       "\n");
 }
 
-const char *arg_interpreter = 0;
-const char *arg_soname = 0;
-strlist_t *arg_abspath = 0;
-strlist_t *arg_abs_nomatch = 0;
-strlist_t *arg_abs_mustmatch = 0;
-strlist_t *arg_needed_add = 0;
-strlist_t *arg_needed_del = 0;
-strlist_t *arg_rpath_add = 0;
-strlist_t *arg_rpath_del = 0;
-const char *arg_rpath_set = 0;
-strlist_t *arg_runpath_add = 0;
-strlist_t *arg_runpath_del = 0;
-const char *arg_runpath_set = 0;
-int arg_compliance = 0;
-
-char *
-make_absolute(char *path)
+strview_t
+make_absolute(emctx_t *ctx, strview_t path)
 {
-  int i, ret, amatch = 0, fmatch = 0;
-  struct stat sb;
-  char absroot[2048], abspath[1024], lib[1024], *s;
-  int flags = FNM_PATHNAME | FNM_PERIOD;
-
-#ifdef FNM_EXTMATCH
-  flags |= FNM_EXTMATCH;
-#endif
+  const emopts_t *opts = ctx->opts;
+  char *lib;
+  size_t dl;
+  int i;
 
-  if (0 == arg_abspath || 0 == arg_abspath->nstrs || 0 == path) {
+  if (0 == opts->abspath || 0 == opts->abspath->nstrs || 0 == path.str) {
     return path;
   }
 
-  if (strchr(path, '/')) {
+  if (memchr(path.str, '/', path.len)) {
     return path;
   }
 
-  if (strstr(path, "$ORIGIN") || strstr(path, "${ORIGIN}")) {
+  if (strstr(path.str, "$ORIGIN") || strstr(path.str, "${ORIGIN}")) {
     return path;
   }
 
-  for (i = 0; i < arg_abs_nomatch->strsz; i++) {
-    char *nm = arg_abs_nomatch->strs[i];
+  if (opts->abs_nomatch_set && globset_match(opts->abs_nomatch_set, path.str)) {
+    return path;
+  }
 
-    if (0 == nm) {
-      continue;
-    }
+  if (opts->abs_mustmatch_set && (0 == globset_match(opts->abs_mustmatch_set, path.str))) {
+    return path;
+  }
 
-    if (0 == fnmatch(nm, path, flags)) {
+  for (i = 0; i < opts->abspath->strsz; i++) {
+    const char *dest = dircache_lookup(i, path.str);
+
+    if (dest) {
+      dl = strlen(dest);
+      lib = (char *)arena_alloc(&ctx->arena, dl + path.len + 2);
+      memcpy(lib, dest, dl);
+      lib[dl] = '/';
+      memcpy(lib + dl + 1, path.str, path.len + 1);
+      path.str = lib;
+      path.len += dl + 1;
       return path;
     }
   }
 
-  for (i = 0; i < arg_abs_mustmatch->strsz; i++) {
-    char *nm = arg_abs_mustmatch->strs[i];
+  return path;
+}
 
-    if (0 == nm) {
-      continue;
+/*
+ * Verify that the identification bytes at the start of a file are those of
+ * an ELF file we know how to deal with. Returns one of the IDENT_xxx values.
+ */
+int
+check_ident(const unsigned char *ident)
+{
+  if ((ident[EI_MAG0] != ELFMAG0) || (ident[EI_MAG1] != ELFMAG1) ||
+      (ident[EI_MAG2] != ELFMAG2) || (ident[EI_MAG3] != ELFMAG3) ||
+      (ident[EI_VERSION] != EV_CURRENT) || ((ident[EI_CLASS] != ELFCLASS32) && (ident[EI_CLASS] != ELFCLASS64))) {
+    return IDENT_NOT_ELF;
+  }
+
+  if ((ident[EI_DATA] != ELFDATA2LSB) && (ident[EI_DATA] != ELFDATA2MSB)) {
+    return IDENT_BYTEORDER;
+  }
+
+  return IDENT_OK;
+}
+
+/*
+ * Triage, map and process an open file whose identification bytes have
+ * already been checked. The caller still owns fd.
+ */
+int
+process_fd(emctx_t *ctx, int fd, size_t flen, unsigned char *hdr, size_t hlen)
+{
+  emfmap_t map;
+  int ret;
+
+  if (triage_file(ctx, fd, flen, hdr, hlen)) {
+    return 0;
+  }
+
+  emstat_add(processed, 1);
+  ctx->fd = fd;
+  fmap_open(&map, &ctx->arena, fd, flen, ctx->opts->read_max);
+  if ((hlen == flen) && (flen <= ctx->opts->read_max)) {
+    fmap_adopt(&map, hdr);
+  }
+  ret = process_file(ctx, &map);
+  if (map.readin) {
+    emstat_add(read_in, 1);
+  } else {
+    emstat_add(windows, map.nwin);
+    emstat_add(bytes_mapped, map.mapped);
+  }
+
+  if (fmap_close(&map) || map.err) {
+    fprintf(ctx->err, "%s error: could not map `%s': %s\n", progname, ctx->curfile, strerror(map.err));
+    ret = 1;
+  }
+
+  return ret;
+}
+
+/*
+ * When the size is not known only the header is read to begin with, as most
+ * files in a tree are not ELF and that is all it takes to skip them. A file
+ * that turns out to be ELF is then read on in the hope of getting all of it,
+ * but no further than EM_READMAX whatever -M says; anything bigger has its
+ * size looked up and is left to fmap_open().
+ */
+ssize_t
+read_start(emctx_t *ctx, int fd, uint64_t size, unsigned char **hdr, size_t *want)
+{
+  uint64_t read_max = ctx->opts->read_max;
+  unsigned char *buf;
+  ssize_t got, more;
+
+  *want = EM_HDRBUF;
+  if ((UINT64_MAX != size) && (size <= read_max)) {
+    *want = (size_t)size;
+  }
+
+  if (*want > EM_HDRBUF) {
+    *hdr = (unsigned char *)arena_alloc(&ctx->arena, *want);
+  }
+
+  got = emsys(pread(fd, *hdr, *want, 0));
+  if ((UINT64_MAX != size) || (got < EM_HDRBUF) || (read_max < EM_HDRBUF) || (IDENT_OK != check_ident(*hdr))) {
+    return got;
+  }
+
+  *want = (size_t)((read_max < EM_READMAX) ? read_max : EM_READMAX) + 1;
+  buf = (unsigned char *)arena_alloc(&ctx->arena, *want);
+  memcpy(buf, *hdr, got);
+  more = emsys(pread(fd, buf + got, *want - got, got));
+  if (more < 0) {
+    return more;
+  }
+  *hdr = buf;
+
+  return got + more;
+}
+
+/*
+ * Return a descriptor for the directory part of path, and point *name at
+ * the rest. Names on the command line and in list files usually come a
+ * directory at a time, so the last directory stays open and a run of names
+ * in it is opened relative to that, which saves looking up the whole path
+ * again for every one of them. If the directory can't be opened the name is
+ * left to be looked up in full, so that any error is reported against it.
+ */
+static int
+path_dirfd(emctx_t *ctx, const char *path, const char **name)
+{
+  const char *slash = strrchr(path, '/');
+  size_t dl;
+
+  *name = path;
+  if (0 == slash) {
+    return AT_FDCWD;
+  }
+
+  dl = (slash == path) ? 1 : (size_t)(slash - path);
+  if (ctx->dir && (strlen(ctx->dir) == dl) && (0 == memcmp(ctx->dir, path, dl))) {
+    *name = slash + 1;
+    return ctx->dirfd;
+  }
+
+  if (ctx->dir) {
+    emsys(close(ctx->dirfd));
+    free(ctx->dir);
+    ctx->dir = 0;
+  }
+
+  ctx->dir = (char *)malloc(dl + 1);
+  memcpy(ctx->dir, path, dl);
+  ctx->dir[dl] = 0;
+  ctx->dirfd = emsys(open(ctx->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (ctx->dirfd < 0) {
+    free(ctx->dir);
+    ctx->dir = 0;
+    return AT_FDCWD;
+  }
+
+  *name = slash + 1;
+  return ctx->dirfd;
+}
+
+void
+ctx_release(emctx_t *ctx)
+{
+  if (ctx->dir) {
+    close(ctx->dirfd);
+    free(ctx->dir);
+    ctx->dir = 0;
+  }
+  arena_free(&ctx->arena);
+}
+
+/*
+ * Process a single named file. This verifies that the file is a valid ELF
+ * file (or at the very least has a valid ELF header) and that it is either
+ * a shared object or an executable, and hands it to the class-specific
+ * processor. We do not process relocatable or archive objects.
+ *
+ * This costs as few system calls as we can manage, each on a descriptor
+ * rather than a path where possible, as on a network filesystem every path
+ * lookup can be a round trip to the server. The file is opened relative to
+ * its directory (see path_dirfd()), asked for just its type and size, and
+ * then a single read gets the identification bytes, the headers that triage
+ * needs and, for a small file, everything process_file() will look at. Only
+ * with a cache or an index do we need the file's full identity, and that
+ * before opening it, so that files they know about are never opened at all.
+ */
+int
+process_path(emctx_t *ctx, const char *path)
+{
+  int ret = 0, fd, dfd;
+  emfid_t id;
+  ssize_t bytes_read;
+  size_t want;
+  uint64_t hbuf[EM_HDRBUF / sizeof(uint64_t)];
+  unsigned char *ehdr = (unsigned char *)hbuf;
+  const char *name;
+
+  ctx->curfile = path;
+  ctx->reject = -1;
+  ctx->written = 0;
+  ctx->xinfo = 0;
+  emstat_add(files, 1);
+
+  dfd = path_dirfd(ctx, path, &name);
+
+  if (ctx->opts->fullid) {
+    if (file_id(dfd, name, 0, 1, &id) < 0) {
+      fprintf(ctx->err, "%s error: could not stat `%s': %s\n", progname, path, strerror(errno));
+      return 1;
     }
 
-    amatch++;
+    if (!S_ISREG(id.mode)) {
+      fprintf(ctx->err, "%s warning: skipping `%s' - not a regular file.\n", progname, path);
+      em_reject(ctx, REJ_NOT_REGULAR);
+      return 0;
+    }
 
-    if (0 == fnmatch(nm, path, flags)) {
-      fmatch = 1;
-      break;
+    if (cache_lookup(&id) || index_lookup(path, &id)) {
+      return 0;
     }
   }
 
-  if (amatch && (0 == fmatch)) {
-    return path;
+  /*
+   * Without a cache we only find out what the file is once it is open, so
+   * make sure opening a device or a FIFO by mistake does not hang.
+   */
+  fd = emsys(openat(dfd, name, (ctx->opts->modify ? O_RDWR : O_RDONLY) | O_NOCTTY | O_NONBLOCK | O_CLOEXEC));
+  if ((fd < 0) && (EISDIR == errno)) {
+    fprintf(ctx->err, "%s warning: skipping `%s' - not a regular file.\n", progname, path);
+    em_reject(ctx, REJ_NOT_REGULAR);
+    return 0;
+  }
+  if (fd < 0) {
+    fprintf(ctx->err, "%s error: could not open `%s': %s\n", progname, path, strerror(errno));
+    return 1;
   }
 
-  for (i = 0; i < arg_abspath->strsz; i++) {
-    char *ap = arg_abspath->strs[i];
+  if (0 == ctx->opts->fullid) {
+    if (file_id(fd, 0, 0, 0, &id) < 0) {
+      fprintf(ctx->err, "%s error: could not stat `%s': %s\n", progname, path, strerror(errno));
+      emsys(close(fd));
+      return 1;
+    }
 
-    if (0 == ap) {
-      continue;
+    if (!S_ISREG(id.mode)) {
+      fprintf(ctx->err, "%s warning: skipping `%s' - not a regular file.\n", progname, path);
+      em_reject(ctx, REJ_NOT_REGULAR);
+      emsys(close(fd));
+      return 0;
     }
+  }
 
-    s = strchr(ap, ':');
-    if (s) {
-      strcpy(absroot, ap);
-      absroot[s - ap] = 0;
-      s++;
-      strcpy(abspath, s);
-    } else {
-      strcpy(abspath, ap);
-      absroot[0] = 0;
+  bytes_read = read_start(ctx, fd, id.size, &ehdr, &want);
+  if (bytes_read < EI_NIDENT) {
+    fprintf(ctx->err, "%s error: could read `%s' header: %s\n", progname, path, strerror(errno));
+    ret = 1;
+  } else {
+    switch (check_ident(ehdr)) {
+      case IDENT_NOT_ELF:
+        fprintf(ctx->err, "%s warning: skipping non-ELF file `%s'\n", progname, path);
+        em_reject(ctx, REJ_NOT_ELF);
+        break;
+
+      case IDENT_BYTEORDER:
+        fprintf(ctx->err, "%s warning: skipping `%s' - unknown byte order.\n", progname, path);
+        em_reject(ctx, REJ_BYTEORDER);
+        break;
+
+      default:
+        ret = process_fd(ctx, fd, (size_t)id.size, ehdr, (size_t)bytes_read);
+        break;
     }
+  }
 
-    sprintf(lib, "%s%s/%s", absroot, abspath, path);
-    ret = stat(lib, &sb);
+  /*
+   * If we changed the file its identity for the cache has changed too.
+   */
+  if ((0 == ret) && ctx->written && ctx->opts->cachefile) {
+    ret = (file_id(fd, 0, 0, 1, &id) < 0);
+  }
+  emsys(close(fd));
+
+  if (0 == ret) {
+    cache_record(&id, (ctx->reject >= 0) ? CACHE_REJECTED : CACHE_DONE);
+    index_record(ctx, &id);
+  }
+  emstat_add(arena_blocks, arena_reset(&ctx->arena));
+
+  return ret;
+}
+
+/*
+ * Display the statistics gathered over the run (-v).
+ */
+void
+display_stats(FILE *fp)
+{
+  uint64_t nrej = 0;
+  int i;
 
-    if (0 == ret) {
-      free(path);
-      return (strdup(lib));
+  for (i = 0; i < REJ_NUM; i++) {
+    nrej += emstats.rejected[i];
+  }
+
+  fprintf(fp, "%s: %" PRIu64 " file%s examined, %" PRIu64 " processed, %" PRIu64 " skipped.\n",
+      progname, plural(emstats.files), emstats.processed, nrej);
+  fprintf(fp, "%s: %" PRIu64 " file%s rejected from the headers alone without mapping.\n",
+      progname, plural(emstats.triaged));
+  if (emstats.patched || emstats.rewritten) {
+    fprintf(fp, "%s: %" PRIu64 " file%s changed in place, %" PRIu64 " rewritten, %" PRIu64 " byte%s written.\n",
+        progname, plural(emstats.patched), emstats.rewritten, plural(emstats.bytes_written));
+  }
+  if (emstats.rewritten) {
+    fprintf(fp, "%s: %" PRIu64 " rewritten file%s shared extents with the original.\n",
+        progname, plural(emstats.cloned));
+  }
+  if (emstats.abs_hits || emstats.abs_misses) {
+    fprintf(fp, "%s: %" PRIu64 " =a lookup%s answered from memory, %" PRIu64 " found.\n",
+        progname, plural(emstats.abs_hits + emstats.abs_misses), emstats.abs_hits);
+  }
+  if (emstats.processed) {
+    fprintf(fp, "%s: %" PRIu64 " block%s of working memory allocated.\n",
+        progname, plural(emstats.arena_blocks));
+    fprintf(fp, "%s: %" PRIu64 " file%s read whole, %" PRIu64 " part%s of the rest mapped, %" PRIu64 " byte%s in all.\n",
+        progname, plural(emstats.read_in), plural(emstats.windows), plural(emstats.bytes_mapped));
+  }
+  if (emstats.files) {
+    fprintf(fp, "%s: %" PRIu64 " system call%s made, %.1f per file examined.\n",
+        progname, plural(emstats.syscalls), (double)emstats.syscalls / emstats.files);
+  }
+  if (emstats.cached) {
+    fprintf(fp, "%s: %" PRIu64 " file%s skipped as unchanged since an earlier run.\n",
+        progname, plural(emstats.cached));
+  }
+
+  for (i = 0; i < REJ_NUM; i++) {
+    if (emstats.rejected[i]) {
+      fprintf(fp, "%s:   %10" PRIu64 "  %s\n", progname, emstats.rejected[i], reject_names[i]);
     }
   }
+}
 
-  return path;
+/*
+ * Submit every file named in a list file ("-" for stdin) to the batch as it
+ * is read, so that processing starts before the producer has finished and
+ * we never hold more than one name at a time. Names are separated by
+ * newlines, or by NUL bytes if delim is 0.
+ */
+static int
+submit_list(embatch_t *batch, const char *listfile, int delim)
+{
+  FILE *fp = stdin;
+  char *line = 0;
+  size_t linesz = 0;
+  ssize_t len;
+  int ret = 0;
+
+  if (strcmp(listfile, "-")) {
+    fp = fopen(listfile, "r");
+    if (0 == fp) {
+      fprintf(stderr, "%s error: could not open `%s': %s\n", progname, listfile, strerror(errno));
+      return 1;
+    }
+  }
+
+  while ((len = getdelim(&line, &linesz, delim, fp)) > 0) {
+    if (line[len - 1] == delim) {
+      line[--len] = 0;
+    }
+    if (0 == len) {
+      continue;
+    }
+    ret = batch_submit(batch, line);
+    if (ret) {
+      break;
+    }
+  }
+
+  free(line);
+  if (fp != stdin) {
+    fclose(fp);
+  }
+
+  return ret;
 }
 
-union msblsb {
-  uint16_t ival;
-  uint8_t bval[2];
-} bocheck;
+static emopts_t opts;
 
 int main(int argc, const char *const argv[])
 {
-  int i, ret, fd;
-  int files = 0, gotwork = 0;
+  int i, ret, files = 0, gotwork = 0, nthreads = 1, delim = '\n';
   size_t sl;
-  struct stat statbuf;
   uint32_t *emdisplay;
-  void *vmaddr;
-  size_t flen;
-  ssize_t bytes_read;
-  unsigned char ehdr[EI_NIDENT];
+  embatch_t *batch;
+  strlist_t *trees;
+  const char *listfile = 0;
+  char *end;
 
   sl = strlen(argv[0]);
   if (sl < 1) {
@@ -329,31 +741,26 @@ int main(int argc, const char *const argv[])
     progname--;
   }
 
-  bocheck.ival = 0x1234;
-  if (bocheck.bval[0] == 0x34) {
-    host_byteorder = ELFDATA2LSB;
-  } else {
-    host_byteorder = ELFDATA2MSB;
-  }
-
-  arg_abspath = sl_new(1);
-  arg_abs_nomatch = sl_new(1);
-  arg_abs_mustmatch = sl_new(1);
-  arg_needed_add = sl_new(1);
-  arg_needed_del = sl_new(1);
-  arg_rpath_add = sl_new(1);
-  arg_rpath_del = sl_new(1);
-  arg_runpath_add = sl_new(1);
-  arg_runpath_del = sl_new(1);
+  opts.abspath = sl_new(1);
+  opts.abs_nomatch = sl_new(1);
+  opts.abs_mustmatch = sl_new(1);
+  opts.needed_add = sl_new(1);
+  opts.needed_del = sl_new(1);
+  opts.rpath_add = sl_new(1);
+  opts.rpath_del = sl_new(1);
+  opts.runpath_add = sl_new(1);
+  opts.runpath_del = sl_new(1);
+  trees = sl_new(1);
+  opts.read_max = EM_READMAX;
 
   for (i = 1; i < argc; i++) {
     const char *arg = argv[i];
 
     if ((arg[0] == '+') || (arg[0] == '-') || (arg[0] == '=')) {
       if (arg[0] == '-') {
-        emdisplay = &emdisplay_before;
+        emdisplay = &opts.display_before;
       } else if (arg[0] == '+') {
-        emdisplay = &emdisplay_after;
+        emdisplay = &opts.display_after;
       } else {
         emdisplay = 0;
       }
@@ -437,8 +844,8 @@ int main(int argc, const char *const argv[])
 
         case 'D':
           if (arg[0] == '=') {
-            emdisplay_before |= (DISPLAY_HEADERS | DISPLAY_DYNAMIC | DISPLAY_DEBUG);
-            emdisplay_after |= (DISPLAY_HEADERS | DISPLAY_DYNAMIC | DISPLAY_DEBUG);
+            opts.display_before |= (DISPLAY_HEADERS | DISPLAY_DYNAMIC | DISPLAY_DEBUG);
+            opts.display_after |= (DISPLAY_HEADERS | DISPLAY_DYNAMIC | DISPLAY_DEBUG);
           } else {
             *emdisplay |= (DISPLAY_HEADERS | DISPLAY_DYNAMIC);
           }
@@ -447,10 +854,10 @@ int main(int argc, const char *const argv[])
 
         case 'A':
           if (arg[0] == '=') {
-            emdisplay_before |= (DISPLAY_INTERP | DISPLAY_SONAME | DISPLAY_NEEDED);
-            emdisplay_before |= (DISPLAY_FLAGS | DISPLAY_RPATH | DISPLAY_RUNPATH);
-            emdisplay_after |= (DISPLAY_INTERP | DISPLAY_SONAME | DISPLAY_NEEDED);
-            emdisplay_after |= (DISPLAY_FLAGS | DISPLAY_RPATH | DISPLAY_RUNPATH);
+            opts.display_before |= (DISPLAY_INTERP | DISPLAY_SONAME | DISPLAY_NEEDED);
+            opts.display_before |= (DISPLAY_FLAGS | DISPLAY_RPATH | DISPLAY_RUNPATH);
+            opts.display_after |= (DISPLAY_INTERP | DISPLAY_SONAME | DISPLAY_NEEDED);
+            opts.display_after |= (DISPLAY_FLAGS | DISPLAY_RPATH | DISPLAY_RUNPATH);
           } else {
             *emdisplay |= (DISPLAY_INTERP | DISPLAY_SONAME | DISPLAY_NEEDED);
             *emdisplay |= (DISPLAY_FLAGS | DISPLAY_RPATH | DISPLAY_RUNPATH);
@@ -467,7 +874,7 @@ missing:
             fprintf(stderr, "%s: option %c%c missing argument. See %s -H for usage.\n", progname, arg[0], arg[1], progname);
             return 1;
           }
-          arg_interpreter = argv[++i];
+          opts.interpreter = argv[++i];
           gotwork = 1;
           break;
 
@@ -478,7 +885,7 @@ missing:
           if (i == argc - 1) {
             goto missing;
           }
-          arg_soname = argv[++i];
+          opts.soname = argv[++i];
           gotwork = 1;
           break;
 
@@ -487,11 +894,11 @@ missing:
             goto missing;
           }
           if (arg[0] == '=') {
-            sl_stradd(arg_abspath, argv[++i]);
+            sl_stradd(opts.abspath, argv[++i]);
           } else if (arg[0] == '-') {
-            sl_stradd(arg_abs_nomatch, argv[++i]);
+            sl_stradd(opts.abs_nomatch, argv[++i]);
           } else if (arg[0] == '+') {
-            sl_stradd(arg_abs_mustmatch, argv[++i]);
+            sl_stradd(opts.abs_mustmatch, argv[++i]);
           } else {
             goto badarg;
           }
@@ -503,9 +910,9 @@ missing:
             goto missing;
           }
           if (arg[0] == '+') {
-            sl_stradd(arg_needed_add, argv[++i]);
+            sl_stradd(opts.needed_add, argv[++i]);
           } else if (arg[0] == '-') {
-            sl_stradd(arg_needed_del, argv[++i]);
+            sl_stradd(opts.needed_del, argv[++i]);
           } else {
             goto badarg;
           }
@@ -517,11 +924,11 @@ missing:
             goto missing;
           }
           if (arg[0] == '+') {
-            sl_stradd(arg_runpath_add, argv[++i]);
+            sl_stradd(opts.runpath_add, argv[++i]);
           } else if (arg[0] == '-') {
-            sl_stradd(arg_runpath_del, argv[++i]);
+            sl_stradd(opts.runpath_del, argv[++i]);
           } else if (arg[0] == '=') {
-            arg_runpath_set = argv[++i];
+            opts.runpath_set = argv[++i];
           } else {
             goto badarg;
           }
@@ -533,22 +940,146 @@ missing:
             goto missing;
           }
           if (arg[0] == '+') {
-            sl_stradd(arg_rpath_add, argv[++i]);
+            sl_stradd(opts.rpath_add, argv[++i]);
           } else if (arg[0] == '-') {
-            sl_stradd(arg_rpath_del, argv[++i]);
+            sl_stradd(opts.rpath_del, argv[++i]);
           } else if (arg[0] == '=') {
-            arg_rpath_set = argv[++i];
+            opts.rpath_set = argv[++i];
           } else {
             goto badarg;
           }
           gotwork = 1;
           break;
 
+        case 'j':
+          if (arg[0] != '-') {
+            goto badarg;
+          }
+          if (i == argc - 1) {
+            goto missing;
+          }
+          nthreads = atoi(argv[++i]);
+          if (nthreads <= 0) {
+            nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+          }
+          break;
+
+        case 'T':
+          if (arg[0] != '-') {
+            goto badarg;
+          }
+          if (i == argc - 1) {
+            goto missing;
+          }
+          sl_stradd(trees, argv[++i]);
+          break;
+
+        case '@':
+          if (arg[0] != '-') {
+            goto badarg;
+          }
+          if (i == argc - 1) {
+            goto missing;
+          }
+          listfile = argv[++i];
+          break;
+
+        case '0':
+          if (arg[0] != '-') {
+            goto badarg;
+          }
+          delim = 0;
+          break;
+
+        case 'C':
+          if (arg[0] != '-') {
+            goto badarg;
+          }
+          if (i == argc - 1) {
+            goto missing;
+          }
+          opts.cachefile = argv[++i];
+          break;
+
+        case 'X':
+          if (arg[0] != '-') {
+            goto badarg;
+          }
+          if (i == argc - 1) {
+            goto missing;
+          }
+          opts.indexfile = argv[++i];
+          gotwork = 1;
+          break;
+
+        case 'W':
+          if (arg[0] != '-') {
+            goto badarg;
+          }
+          if (i == argc - 1) {
+            goto missing;
+          }
+          opts.where = argv[++i];
+          break;
+
+        case 'Q':
+          if (arg[0] != '-') {
+            goto badarg;
+          }
+          if (i == argc - 1) {
+            goto missing;
+          }
+          opts.query = argv[++i];
+          break;
+
+        case 'M':
+          if (arg[0] != '-') {
+            goto badarg;
+          }
+          if (i == argc - 1) {
+            goto missing;
+          }
+          i++;
+          errno = 0;
+          opts.read_max = strtoull(argv[i], &end, 0);
+          if ((end == argv[i]) || *end || (ERANGE == errno) || (opts.read_max >= SIZE_MAX)) {
+            fprintf(stderr, "%s: invalid size `%s' for option -M. See %s -H for usage.\n", progname, argv[i], progname);
+            return 1;
+          }
+          break;
+
+        case 'o':
+          if (arg[0] != '-') {
+            goto badarg;
+          }
+          if (i == argc - 1) {
+            goto missing;
+          }
+          i++;
+          if (0 == strcmp(argv[i], "text")) {
+            opts.format = REC_TEXT;
+          } else if (0 == strcmp(argv[i], "jsonl")) {
+            opts.format = REC_JSONL;
+          } else if (0 == strcmp(argv[i], "cbor")) {
+            opts.format = REC_CBOR;
+          } else {
+            fprintf(stderr, "%s: unknown output format `%s'. See %s -H for usage.\n", progname, argv[i], progname);
+            return 1;
+          }
+          break;
+
+        case 'v':
+          if (arg[0] != '-') {
+            goto badarg;
+          }
+          opts.stats = 1;
+          break;
+
         case 'c':
           if (arg[0] == '-') {
-            arg_compliance |= 1;
+            opts.compliance |= 1;
           } else if (arg[0] == '+') {
-            arg_compliance |= 2;
+            opts.compliance |= 2;
           } else {
             goto badarg;
           }
@@ -566,22 +1097,45 @@ badarg:
     }
   }
 
-  if (arg_rpath_set && (arg_rpath_add->nstrs + arg_rpath_del->nstrs)) {
+  if (opts.rpath_set && (opts.rpath_add->nstrs + opts.rpath_del->nstrs)) {
     fprintf(stderr, "%s: error: cannot use =p and -p or +p. See %s -H for usage.\n", progname, progname);
     return 1;
   }
 
-  if (arg_runpath_set && (arg_runpath_add->nstrs + arg_runpath_del->nstrs)) {
+  if (opts.runpath_set && (opts.runpath_add->nstrs + opts.runpath_del->nstrs)) {
     fprintf(stderr, "%s: error: cannot use =r and -r or +r. See %s -H for usage.\n", progname, progname);
     return 1;
   }
 
-  if ((arg_rpath_set || (arg_rpath_add->nstrs + arg_rpath_del->nstrs)) && (arg_runpath_set || (arg_runpath_add->nstrs + arg_runpath_del->nstrs))) {
+  if ((opts.rpath_set || (opts.rpath_add->nstrs + opts.rpath_del->nstrs)) && (opts.runpath_set || (opts.runpath_add->nstrs + opts.runpath_del->nstrs))) {
     fprintf(stderr, "%s: error: cannot mix -p/+p/=p and -r/+r/=r. See %s -H for usage.\n", progname, progname);
     return 1;
   }
 
-  if (0 == files) {
+  if (opts.query) {
+    if (0 == opts.indexfile) {
+      fprintf(stderr, "%s error: -Q needs an index given with -X. See %s -H for usage.\n", progname, progname);
+      return 1;
+    }
+    if (files || trees->nstrs || listfile) {
+      fprintf(stderr, "%s error: -Q does not process any files. See %s -H for usage.\n", progname, progname);
+      return 1;
+    }
+    return index_query(opts.indexfile, opts.query, stdout);
+  }
+
+  if (opts.where) {
+    opts.select = select_compile(opts.where);
+    if (0 == opts.select) {
+      return 1;
+    }
+    if (0 == gotwork) {
+      opts.select_only = 1;
+      gotwork = 1;
+    }
+  }
+
+  if ((0 == files) && (0 == trees->nstrs) && (0 == listfile)) {
     fprintf(stderr, "%s error: missing file(s) to process. See %s -H for usage.\n", progname, progname);
     return 1;
   }
@@ -591,76 +1145,91 @@ badarg:
     return 0;
   }
 
-  if (arg_soname && files > 1) {
+  if (opts.soname && ((files > 1) || trees->nstrs || listfile)) {
     fprintf(stderr, "%s error: =s only makes sense with a single file. See %s -H.\n", progname, progname);
     return 1;
   }
 
-  for (i = files; i < argc; i++) {
-    curfile = argv[i];
+  opts.modify = (opts.interpreter || opts.soname || opts.rpath_set || opts.runpath_set || opts.compliance ||
+      opts.abspath->nstrs || opts.needed_add->nstrs || opts.needed_del->nstrs ||
+      opts.rpath_add->nstrs || opts.rpath_del->nstrs || opts.runpath_add->nstrs || opts.runpath_del->nstrs);
+
+  if (opts.indexfile && (opts.modify || opts.cachefile)) {
+    fprintf(stderr, "%s error: -X cannot be used with -C or options that change files. See %s -H.\n", progname, progname);
+    return 1;
+  }
+  if (opts.cachefile && (0 == opts.modify)) {
+    fprintf(stderr, "%s error: -C only works with options that change files. See %s -H.\n", progname, progname);
+    return 1;
+  }
+  opts.fullid = (opts.cachefile || opts.indexfile);
+
+  if (opts.indexfile && index_open(&opts)) {
+    return 1;
+  }
 
-    ret = stat(argv[i], &statbuf);
+  if (opts.cachefile && cache_open(&opts)) {
+    return 1;
+  }
 
-    if (ret < 0) {
-      fprintf(stderr, "%s error: could not stat `%s': %s\n", progname, curfile, strerror(errno));
-      return 1;
-    }
+  if (opts.abspath->nstrs) {
+    int flags = FNM_PATHNAME | FNM_PERIOD;
 
-    if (S_ISDIR(statbuf.st_mode) || S_ISCHR(statbuf.st_mode) || S_ISBLK(statbuf.st_mode)) {
-      fprintf(stderr, "%s warning: skipping `%s' - not a regular file.\n", progname, curfile);
-      continue;
-    }
+#ifdef FNM_EXTMATCH
+    flags |= FNM_EXTMATCH;
+#endif
 
-    fd = open(curfile, O_RDONLY);
-    if (fd < 0) {
-      fprintf(stderr, "%s error: could not open `%s': %s\n", progname, curfile, strerror(errno));
-      return 1;
+    dircache_open(opts.abspath);
+    if (opts.abs_nomatch->nstrs) {
+      opts.abs_nomatch_set = globset_new(opts.abs_nomatch, flags);
     }
-
-    /*
-     * Verify that the specified file is a valid ELF file (or the very least
-     * has a valid ELF header) and that it is either a shared objected or an
-     * executable. We do not process relocatable or archive objects.
-     */
-    bytes_read = read(fd, ehdr, EI_NIDENT);
-    if (bytes_read != EI_NIDENT) {
-      fprintf(stderr, "%s error: could read `%s' header: %s\n", progname, curfile, strerror(errno));
-      close(fd);
-      return 1;
+    if (opts.abs_mustmatch->nstrs) {
+      opts.abs_mustmatch_set = globset_new(opts.abs_mustmatch, flags);
     }
+  }
 
-    if ((ehdr[EI_MAG0] != ELFMAG0) || (ehdr[EI_MAG1] != ELFMAG1) ||
-        (ehdr[EI_MAG2] != ELFMAG2) || (ehdr[EI_MAG3] != ELFMAG3) ||
-        (ehdr[EI_VERSION] != EV_CURRENT) || ((ehdr[EI_CLASS] != ELFCLASS32) && (ehdr[EI_CLASS] != ELFCLASS64))) {
-      fprintf(stderr, "%s warning: skipping non-ELF file `%s'\n", progname, curfile);
-      close(fd);
-      continue;
+  batch = batch_new(&opts, nthreads);
+  ret = 0;
+  for (i = files; files && (i < argc); i++) {
+    ret = batch_submit(batch, argv[i]);
+    if (ret) {
+      break;
     }
+  }
 
-    if (ehdr[EI_DATA] != host_byteorder) {
-      fprintf(stderr, "%s warning: skipping endian-mismatched file `%s'\n", progname, curfile);
-      close(fd);
-      continue;
-    }
+  if ((0 == ret) && listfile) {
+    ret = submit_list(batch, listfile, delim);
+  }
 
-    flen = (size_t)statbuf.st_size;
-    vmaddr = mmap(0, flen, PROT_READ, MAP_SHARED, fd, 0);
-    if (0 == vmaddr) {
-      fprintf(stderr, "%s error: could not map `%s': %s\n", progname, curfile, strerror(errno));
-      close(fd);
-      return 1;
-    }
+  ret = batch_finish(batch) | ret;
 
-    close(fd);
-    process_file(vmaddr, flen);
+  if ((0 == ret) && trees->nstrs) {
+    fflush(stdout);
+    ret = tree_walk(&opts, trees, nthreads);
+  }
 
-    if (munmap(vmaddr, flen)) {
-      fprintf(stderr, "%s error: could not unmap `%s': %s\n", progname, curfile, strerror(errno));
-      return 1;
-    }
+  if (opts.cachefile) {
+    ret |= cache_close();
+  }
+
+  if (opts.indexfile) {
+    ret |= index_close();
+  }
+
+  select_free(opts.select);
+
+  if (opts.abspath->nstrs) {
+    dircache_close();
+    globset_free(opts.abs_nomatch_set);
+    globset_free(opts.abs_mustmatch_set);
+  }
+
+  if (opts.stats) {
+    fflush(stdout);
+    display_stats(stderr);
   }
 
-  return 0;
+  return ret;
 }
 
 /*
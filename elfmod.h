@@ -56,40 +56,390 @@
 #define DISPLAY_EVERYTHING      ((1U << DISPLAY_NUMENT) - 1)
 
 extern const char *progname;
-extern const char *curfile;
 
-extern uint32_t emdisplay_before;
-extern uint32_t emdisplay_after;
+/*
+ * globset.c compiles a list of fnmatch() patterns into a set that any name
+ * can be matched against in time proportional to the length of the name.
+ * globset_match() returns non-zero if any pattern in the set matches, as
+ * fnmatch() would with the flags the set was built with.
+ */
+typedef struct globset globset_t;
+
+extern globset_t *globset_new(const strlist_t *patterns, int flags);
+extern int globset_match(const globset_t *gs, const char *name);
+extern void globset_free(globset_t *gs);
+
+typedef struct emsel emsel_t;
+
+/*
+ * Options gathered from the command line. These are filled in once by main()
+ * and are read-only from then on, so a single copy is shared by every file
+ * being processed, regardless of which thread is processing it.
+ */
+typedef struct {
+  uint32_t display_before;      /* DISPLAY_xxx bits shown before any work */
+  uint32_t display_after;       /* DISPLAY_xxx bits shown after all work */
+  const char *interpreter;
+  const char *soname;
+  strlist_t *abspath;
+  strlist_t *abs_nomatch;
+  strlist_t *abs_mustmatch;
+  globset_t *abs_nomatch_set;   /* The two above, compiled */
+  globset_t *abs_mustmatch_set;
+  strlist_t *needed_add;
+  strlist_t *needed_del;
+  strlist_t *rpath_add;
+  strlist_t *rpath_del;
+  const char *rpath_set;
+  strlist_t *runpath_add;
+  strlist_t *runpath_del;
+  const char *runpath_set;
+  int compliance;
+  int stats;                    /* Display run statistics at the end (-v) */
+  const char *cachefile;        /* Incremental run cache (-C) */
+  int modify;                   /* Options that change files were given */
+  uint64_t read_max;            /* Files up to this size are read, not mapped (-M) */
+  int format;                   /* REC_xxx form of the displays (-o) */
+  const char *indexfile;        /* Index of dynamic metadata (-X) */
+  const char *query;            /* Question for that index (-Q) */
+  int fullid;                   /* Files' full identity is needed before opening them */
+  const char *where;            /* Predicate files must match (-W) */
+  emsel_t *select;              /* The same, compiled */
+  int select_only;              /* -W is all there is to do: list the matches */
+} emopts_t;
+
+typedef struct emxinfo emxinfo_t;
+
+/*
+ * Per-file processing context. Everything the per-class processors need to
+ * know about the file currently being worked on lives here rather than in
+ * globals, so that several files can be processed at the same time. All
+ * output for the file goes to the out and err streams, which are stdout and
+ * stderr for a serial run, or per-file buffers when running with -j.
+ */
+typedef struct {
+  const emopts_t *opts;         /* Command line options */
+  const char *curfile;          /* Name of the file being processed */
+  FILE *out;                    /* Where normal output goes */
+  FILE *err;                    /* Where warnings and errors go */
+  int reject;                   /* REJ_xxx reason the file was passed over, or -1 */
+  int fd;                       /* Open file, writable if opts->modify */
+  int written;                  /* The file was changed */
+  emarena_t arena;              /* Working memory, reset after every file */
+  char *dir;                    /* Directory dirfd is open on, or 0 */
+  int dirfd;
+  emxinfo_t *xinfo;             /* What the index should record for the file, or 0 */
+} emctx_t;
+
+/*
+ * Release everything a context holds once it is no longer needed.
+ */
+extern void ctx_release(emctx_t *ctx);
+
+/*
+ * filemap.c maps the parts of a file that the processors ask for, each
+ * rounded out to whole pages, instead of the whole file. Files of no more
+ * than read_max bytes are instead read whole into the arena, which is
+ * cheaper for a small file than setting up and tearing down a mapping.
+ * fmap_get() returns a pointer to [off, off + len) of the file, valid until
+ * fmap_close(), or 0 if that range is not in the file or could not be read
+ * or mapped (in which case err holds the errno). A file that was read in
+ * does not see later writes to it until fmap_refresh(). fmap_adopt() hands
+ * over a buffer already holding the whole file, which is then used as if
+ * it had been read in.
+ */
+#define EM_READMAX              (64 * 1024)
+
+typedef struct {
+  unsigned char *base;
+  uint64_t off;                 /* Where in the file base is */
+  uint64_t len;
+} emfwin_t;
+
+typedef struct {
+  int fd;
+  int err;                      /* errno from the first failed mmap(), or 0 */
+  int readin;                   /* The file was read whole into win[0] */
+  uint64_t flen;
+  uint64_t read_max;
+  uint64_t mapped;              /* Total bytes in all windows */
+  emfwin_t *win;                /* Windows so far, in the arena */
+  unsigned int nwin;
+  unsigned int capwin;
+  emarena_t *arena;
+} emfmap_t;
+
+extern void fmap_open(emfmap_t *m, emarena_t *arena, int fd, uint64_t flen, uint64_t read_max);
+extern void fmap_adopt(emfmap_t *m, unsigned char *buf);
+extern const void *fmap_get(emfmap_t *m, uint64_t off, uint64_t len);
+extern int fmap_refresh(emfmap_t *m);
+extern int fmap_close(emfmap_t *m);
+
+/*
+ * Returns the full path =a found for a library, or path itself if there
+ * isn't one. path must be NUL terminated where it ends.
+ */
+extern strview_t make_absolute(emctx_t *ctx, strview_t path);
+
+/*
+ * Reasons a file can be passed over without being processed. Counts of each
+ * are kept in emstats and displayed at the end of the run with -v.
+ */
+#define REJ_NOT_REGULAR         0       /* Directory or device */
+#define REJ_NOT_ELF             1       /* Bad magic, version or class */
+#define REJ_BYTEORDER           2       /* Neither little nor big endian */
+#define REJ_TRUNCATED           3       /* Headers extend past end of file */
+#define REJ_TYPE                4       /* Not ET_EXEC or ET_DYN */
+#define REJ_NO_PHDRS            5       /* No program headers */
+#define REJ_NO_INTERP           6       /* Executable without PT_INTERP */
+#define REJ_NO_DYNAMIC          7       /* No PT_DYNAMIC segment */
+#define REJ_NO_STRTAB           8       /* No DT_STRTAB */
+#define REJ_NO_STRSZ            9       /* No DT_STRSZ */
+#define REJ_NO_DYNSTR           10      /* DT_STRTAB not in a loadable segment */
+#define REJ_NO_DYNSECT          11      /* No section backing PT_DYNAMIC */
+#define REJ_NOT_SELECTED        12      /* Does not match -W */
+#define REJ_NUM                 13
+
+/*
+ * Run-wide statistics. These are updated from every worker thread, so
+ * always use emstat_add() to change them.
+ */
+typedef struct {
+  uint64_t files;               /* Files examined */
+  uint64_t triaged;             /* Rejected from the headers alone, never mapped */
+  uint64_t processed;           /* Files handed to the processors */
+  uint64_t cached;              /* Skipped as unchanged since an earlier run */
+  uint64_t patched;             /* Files changed in place */
+  uint64_t rewritten;           /* Files replaced by a changed copy */
+  uint64_t cloned;              /* Of those, copies sharing the original's extents */
+  uint64_t bytes_written;       /* Total bytes written to changed files */
+  uint64_t abs_hits;            /* =a lookups that found the library */
+  uint64_t abs_misses;          /* =a lookups that did not */
+  uint64_t arena_blocks;        /* Blocks of per-file working memory allocated */
+  uint64_t read_in;             /* Files read whole rather than mapped */
+  uint64_t windows;             /* Parts of files mapped */
+  uint64_t bytes_mapped;        /* Total size of those */
+  uint64_t syscalls;            /* System calls made working on files */
+  uint64_t rejected[REJ_NUM];   /* Files passed over, by reason */
+} emstats_t;
+
+extern emstats_t emstats;
+
+#define emstat_add(field, n) __atomic_add_fetch(&emstats.field, (n), __ATOMIC_RELAXED)
+
+/*
+ * Wrap each system call made in reading, mapping and writing files, so that
+ * -v can show how many each file costs on average.
+ */
+#define emsys(call)             (emstat_add(syscalls, 1), (call))
+
+extern void display_stats(FILE *fp);
+
+/*
+ * Record that the current file is being passed over, and why.
+ */
+static inline void
+em_reject(emctx_t *ctx, int reason)
+{
+  ctx->reject = reason;
+  emstat_add(rejected[reason], 1);
+}
+
+/*
+ * The identity of a file on disk, as far as the run cache is concerned. If
+ * any of these change the file has to be looked at again.
+ */
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime_ns;
+  uint32_t mode;
+} emfid_t;
 
 /*
- * Options gathered from the command line, defined in elfmod.c and consumed
- * by the per-class file processors.
+ * cache.c keeps a memory-mapped record of the files earlier runs with the
+ * same options found nothing (more) to do with, so that unchanged files can
+ * be skipped after a single statx(). file_id() is that statx(), on a name
+ * relative to dfd or, if name is 0, on dfd itself. Unless full is set only
+ * the mode and size are asked for, which is all that is needed to process a
+ * file, and may save the filesystem some work.
  */
-extern const char *arg_interpreter;
-extern const char *arg_soname;
-extern strlist_t *arg_abspath;
-extern strlist_t *arg_abs_nomatch;
-extern strlist_t *arg_abs_mustmatch;
-extern strlist_t *arg_needed_add;
-extern strlist_t *arg_needed_del;
-extern strlist_t *arg_rpath_add;
-extern strlist_t *arg_rpath_del;
-extern const char *arg_rpath_set;
-extern strlist_t *arg_runpath_add;
-extern strlist_t *arg_runpath_del;
-extern const char *arg_runpath_set;
-extern int arg_compliance;
+#define CACHE_DONE              1       /* Processed, nothing left to do */
+#define CACHE_REJECTED          2       /* Not a file we process */
 
-extern char *make_absolute(char *path);
+extern int file_id(int dfd, const char *name, int flags, int full, emfid_t *id);
+extern int cache_open(const emopts_t *opts);
+extern int cache_lookup(const emfid_t *id);
+extern void cache_record(const emfid_t *id, int outcome);
+extern int cache_close(void);
+
+/*
+ * index.c keeps a memory-mapped index (-X) of the dynamic section of every
+ * file processed, which questions about the whole set can then be put to
+ * (-Q) without opening any of them. The processors fill in an emxinfo_t,
+ * allocated from the arena, for each file they get as far as reading the
+ * dynamic section of, and index_record() takes a copy of it. It is also
+ * what -W predicates are tested against.
+ */
+struct emxinfo {
+  const char *interp;           /* These are 0 if the file has none */
+  const char *soname;
+  const char *rpath;
+  const char *runpath;
+  const char **needed;
+  uint32_t nneeded;
+  uint32_t flags;               /* DT_FLAGS, and the tags it replaced */
+  uint32_t flags_1;             /* DT_FLAGS_1 */
+  uint32_t status;              /* IX_ORIGIN, IX_FLAGS_1 */
+};
+
+#define IX_ORIGIN               (1U << 1)       /* Uses $ORIGIN somewhere */
+#define IX_FLAGS_1              (1U << 2)       /* Has a DT_FLAGS_1 entry */
+
+extern int index_open(const emopts_t *opts);
+extern int index_lookup(const char *path, const emfid_t *id);
+extern void index_record(emctx_t *ctx, const emfid_t *id);
+extern int index_close(void);
+extern int index_query(const char *indexfile, const char *query, FILE *out);
+
+/*
+ * select.c compiles a -W predicate into a short program, once, which
+ * select_match() then runs against each file.
+ */
+extern emsel_t *select_compile(const char *expr);
+extern int select_match(const emsel_t *sel, const emxinfo_t *xi);
+extern void select_free(emsel_t *sel);
+
+/*
+ * rewrite.c makes the copy of the current file that an edit which needs
+ * parts of the file to move is written to. rewrite_begin() creates a new,
+ * as yet unnamed, file next to ctx->curfile with the same first flen bytes
+ * as ctx->fd, sharing the original's extents where the filesystem allows.
+ * rewrite_finish() gives it the original's owner and mode and atomically
+ * renames it over the original, after which ctx->fd refers to the new file.
+ * rewrite_abort() throws the copy away. Both of the first two report their
+ * own errors and return non-zero on failure, having cleaned up.
+ */
+typedef struct {
+  int fd;                       /* The new copy */
+  int cloned;                   /* Non-zero if it shares extents with the original */
+  char *path;                   /* Resolved name of the file being replaced */
+  char *tmpname;                /* Name of the copy, once it has one */
+} emrewrite_t;
+
+extern int rewrite_begin(emctx_t *ctx, size_t flen, emrewrite_t *rw);
+extern int rewrite_finish(emctx_t *ctx, emrewrite_t *rw);
+extern void rewrite_abort(emrewrite_t *rw);
+
+/*
+ * Return values from check_ident().
+ */
+#define IDENT_OK                0       /* An ELF file we can process */
+#define IDENT_NOT_ELF           1       /* Not ELF, or a class we don't know */
+#define IDENT_BYTEORDER         2       /* ELF but of no byte order we know */
+
+extern int check_ident(const unsigned char *ident);
+
+/*
+ * The EI_DATA value of files in the host's byte order.
+ */
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define ELFDATA_HOST            ELFDATA2MSB
+#else
+#define ELFDATA_HOST            ELFDATA2LSB
+#endif
+
+/*
+ * Number of bytes read from the start of each file before deciding whether
+ * to map it. This covers the ELF header and, in all but the most unusual
+ * files, the whole program header table.
+ */
+#define EM_HDRBUF               4096
+
+/*
+ * Open, verify, map and process a single named file. Returns 0 if the file
+ * was processed or skipped, or non-zero for errors that should stop the run.
+ * process_fd() does the triage, map and process part for a file that is
+ * already open, given the first hlen bytes of it in hdr, whose
+ * identification bytes have been checked. read_start() reads those bytes:
+ * *hdr must point to an EM_HDRBUF byte buffer, but a file of no more than
+ * read_max bytes is read whole, into the arena if need be, and then
+ * process_fd() uses that rather than reading it again. size may be
+ * UINT64_MAX if it is not known yet, in which case only an ELF file is read
+ * past its header, and reading fewer than the *want bytes asked for means
+ * the whole file was read.
+ */
+extern int process_path(emctx_t *ctx, const char *path);
+extern ssize_t read_start(emctx_t *ctx, int fd, uint64_t size, unsigned char **hdr, size_t *want);
+extern int process_fd(emctx_t *ctx, int fd, size_t flen, unsigned char *hdr, size_t hlen);
+
+/*
+ * batch.c feeds file names to process_path(), either directly or on a pool
+ * of worker threads (-j). With threads each file's output is buffered and
+ * written out in the order the files were submitted, so the output of a
+ * threaded run is identical to that of a serial run.
+ */
+typedef struct embatch embatch_t;
+
+extern embatch_t *batch_new(const emopts_t *opts, int nthreads);
+extern int batch_submit(embatch_t *b, const char *path);
+extern int batch_finish(embatch_t *b);
+
+/*
+ * Directories are read with getdents64 directly rather than through
+ * readdir(), as that lets us size the buffer and avoids a DIR allocation
+ * per directory.
+ */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/*
+ * dircache.c reads each =a directory once at startup, so that
+ * make_absolute() never has to go to the filesystem. dircache_lookup()
+ * returns the destination directory (the part after any colon) of the dir'th
+ * =a path if name exists in it, or 0 if it doesn't. It is safe to call from
+ * any thread.
+ */
+extern void dircache_open(const strlist_t *abspath);
+extern const char *dircache_lookup(int dir, const char *name);
+extern void dircache_close(void);
+
+/*
+ * treewalk.c processes every ELF file found below a directory (-T), on
+ * nthreads threads that share the directories still to be read by stealing
+ * them from each other. Returns non-zero if any file or directory could not
+ * be read.
+ */
+extern int tree_walk(const emopts_t *opts, const strlist_t *roots, int nthreads);
+
+/*
+ * process.c dispatches on the ELF class and byte order of the file being
+ * processed to one of the processors built from realproc.inc (see proc32.c
+ * and proc64.c, and proc32x.c and proc64x.c for files whose byte order is
+ * not the host's).
+ */
+extern int process_file(emctx_t *ctx, emfmap_t *map);
+extern int process_file_32(emctx_t *ctx, emfmap_t *map);
+extern int process_file_64(emctx_t *ctx, emfmap_t *map);
+extern int process_file_32x(emctx_t *ctx, emfmap_t *map);
+extern int process_file_64x(emctx_t *ctx, emfmap_t *map);
 
 /*
- * process.c dispatches on the ELF class in the file being processed to one
- * of the class-specific processors built from realproc.inc (see proc32.c
- * and proc64.c).
+ * Decide from the ELF header and program header table alone whether a file
+ * could be processed at all, without mapping it. Returns 0 if it could, or
+ * 1 if not, in which case the reason has been reported and counted.
  */
-extern int process_file(unsigned char *data, size_t dlen);
-extern int process_file_32(unsigned char *data, size_t dlen);
-extern int process_file_64(unsigned char *data, size_t dlen);
+extern int triage_file(emctx_t *ctx, int fd, size_t flen, const unsigned char *hdr, size_t hlen);
+extern int triage_file_32(emctx_t *ctx, int fd, size_t flen, const unsigned char *hdr, size_t hlen);
+extern int triage_file_64(emctx_t *ctx, int fd, size_t flen, const unsigned char *hdr, size_t hlen);
+extern int triage_file_32x(emctx_t *ctx, int fd, size_t flen, const unsigned char *hdr, size_t hlen);
+extern int triage_file_64x(emctx_t *ctx, int fd, size_t flen, const unsigned char *hdr, size_t hlen);
 
 #endif /* ELFMOD_H */
 
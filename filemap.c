@@ -0,0 +1,229 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Map just the parts of a file that are asked for, rather than the whole of
+ * it. Most of a large binary is text, data and debug information that we
+ * never look at, and mapping all of it reserves that much address space for
+ * nothing (more than there is, for a multi-gigabyte file in a 32-bit build).
+ * Each request is rounded out to whole pages and mapped as a window of its
+ * own unless an earlier window already covers it. Windows stay mapped until
+ * fmap_close(), so a pointer into one stays valid for the whole file. Files
+ * no bigger than FMAP_WHOLE are mapped in one go on the first request, which
+ * costs no more than mapping the pieces.
+ *
+ * Smaller files still, up to read_max bytes (-M), are not mapped at all but
+ * read with a single pread() into the arena. As the arena keeps its largest
+ * block from file to file, that is in effect a buffer reused by every file
+ * processed on the same thread, and it saves the mmap(), the munmap() and
+ * the page faults in between.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "elfmod.h"
+
+#define FMAP_WHOLE              (1024 * 1024)
+
+static uint64_t pagesize;
+
+void
+fmap_open(emfmap_t *m, emarena_t *arena, int fd, uint64_t flen, uint64_t read_max)
+{
+  memset(m, 0, sizeof(*m));
+  m->arena = arena;
+  m->fd = fd;
+  m->flen = flen;
+  m->read_max = read_max;
+
+  if (0 == pagesize) {
+    pagesize = (uint64_t)sysconf(_SC_PAGESIZE);
+  }
+}
+
+/*
+ * Read the whole file into base, which is m->flen bytes long.
+ */
+static int
+fmap_read(emfmap_t *m, unsigned char *base)
+{
+  uint64_t done = 0;
+  ssize_t n;
+
+  while (done < m->flen) {
+    n = emsys(pread(m->fd, base + done, (size_t)(m->flen - done), (off_t)done));
+    if (n <= 0) {
+      m->err = n ? errno : EIO;
+      return 1;
+    }
+    done += n;
+  }
+
+  return 0;
+}
+
+/*
+ * Add a window to the list.
+ */
+static emfwin_t *
+fmap_add(emfmap_t *m, unsigned char *base, uint64_t off, uint64_t len)
+{
+  emfwin_t *w;
+
+  if (m->nwin == m->capwin) {
+    unsigned int ncap = m->capwin ? 2 * m->capwin : 8;
+
+    m->win = (emfwin_t *)arena_grow(m->arena, m->win, m->capwin * sizeof(emfwin_t), ncap * sizeof(emfwin_t));
+    m->capwin = ncap;
+  }
+
+  w = &m->win[m->nwin++];
+  w->base = base;
+  w->off = off;
+  w->len = len;
+
+  return w;
+}
+
+/*
+ * Use buf, which holds the whole file, as if it had been read in.
+ */
+void
+fmap_adopt(emfmap_t *m, unsigned char *buf)
+{
+  m->readin = 1;
+  fmap_add(m, buf, 0, m->flen);
+}
+
+/*
+ * Return a pointer to [off, off + len) of the file, or 0 if that is not all
+ * within the file or it could not be read or mapped. In the latter case
+ * m->err is set to the errno from pread() or mmap().
+ */
+const void *
+fmap_get(emfmap_t *m, uint64_t off, uint64_t len)
+{
+  emfwin_t *w;
+  uint64_t start, end;
+  unsigned int i;
+  void *base;
+
+  if (0 == len) {
+    len = 1;
+  }
+
+  if ((off >= m->flen) || (len > m->flen - off)) {
+    return 0;
+  }
+
+  for (i = 0; i < m->nwin; i++) {
+    w = &m->win[i];
+    if ((off >= w->off) && (off + len <= w->off + w->len)) {
+      return w->base + (off - w->off);
+    }
+  }
+
+  if ((0 == m->nwin) && (m->flen <= m->read_max)) {
+    base = arena_alloc(m->arena, (size_t)m->flen);
+    if (fmap_read(m, (unsigned char *)base)) {
+      return 0;
+    }
+    m->readin = 1;
+    w = fmap_add(m, (unsigned char *)base, 0, m->flen);
+    return w->base + off;
+  }
+
+  if (m->flen <= FMAP_WHOLE) {
+    start = 0;
+    end = m->flen;
+  } else {
+    start = off & ~(pagesize - 1);
+    end = off + len;
+    if (end < m->flen) {
+      end = (end + pagesize - 1) & ~(pagesize - 1);
+    }
+  }
+
+  if ((uint64_t)(size_t)(end - start) != end - start) {
+    m->err = ENOMEM;
+    return 0;
+  }
+
+  base = emsys(mmap(0, (size_t)(end - start), PROT_READ, MAP_SHARED, m->fd, (off_t)start));
+  if (MAP_FAILED == base) {
+    m->err = errno;
+    return 0;
+  }
+  emsys(madvise(base, (size_t)(end - start), MADV_WILLNEED));
+
+  w = fmap_add(m, (unsigned char *)base, start, end - start);
+  m->mapped += end - start;
+
+  return w->base + (off - start);
+}
+
+/*
+ * Bring a file that was read in up to date with what has been written to it
+ * since. Mapped windows are shared with the file, so see any writes anyway.
+ * Returns non-zero if the file could not be read again.
+ */
+int
+fmap_refresh(emfmap_t *m)
+{
+  if (m->readin) {
+    return fmap_read(m, m->win[0].base);
+  }
+  return 0;
+}
+
+/*
+ * Unmap every window. The window list itself lives in the arena, and goes
+ * when that is next reset. Returns non-zero if anything could not be
+ * unmapped.
+ */
+int
+fmap_close(emfmap_t *m)
+{
+  unsigned int i;
+  int ret = 0;
+
+  for (i = m->readin; i < m->nwin; i++) {
+    if (emsys(munmap(m->win[i].base, (size_t)m->win[i].len))) {
+      m->err = errno;
+      ret = 1;
+    }
+  }
+  m->nwin = 0;
+
+  return ret;
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
@@ -0,0 +1,252 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fnmatch.h>
+
+#include "elfmod.h"
+
+/*
+ * A set of fnmatch() patterns compiled into a form where matching a name
+ * against all of them costs roughly the length of the name rather than the
+ * number of patterns times that. Nearly all of the patterns people actually
+ * write are a literal name, or a literal prefix and/or suffix around a single
+ * `*' ("libc.so.*", "*.so.6", "libfoo*.so"). Those are entered into one hash
+ * table, keyed on the literal part: the whole name, the text before the `*'
+ * or the text after it. A name is then matched by hashing each of its own
+ * prefixes and suffixes incrementally and probing the table at each length.
+ * Anything else (`?', bracket expressions, escapes, extended patterns, more
+ * than one `*') is kept on a short list and handed to fnmatch() as before.
+ *
+ * The set refers to the strings in the pattern list it was built from, so
+ * that list must outlive it. Names are assumed not to contain `/'
+ * (make_absolute() leaves those alone). One that does is matched with
+ * fnmatch() against every pattern, so that FNM_PATHNAME still means what it
+ * always did.
+ */
+#define GS_WHOLE                1       /* Literal pattern */
+#define GS_FRONT                2       /* "A*" or "A*B" with A not empty */
+#define GS_BACK                 3       /* "*B" with B not empty */
+
+typedef struct {
+  const char *key;              /* Literal text the entry is found by, 0 if empty */
+  size_t klen;
+  const char *tail;             /* For "A*B", B (else 0) */
+  size_t tlen;
+  uint32_t hash;
+  int kind;                     /* GS_xxx above */
+} gsent_t;
+
+struct globset {
+  gsent_t *ents;
+  size_t mask;
+  int anyname;                  /* A bare `*' was given */
+  int flags;                    /* fnmatch() flags */
+  const char **slow;            /* Patterns left to fnmatch() */
+  int nslow;
+  const strlist_t *all;         /* Every pattern, for names with a `/' */
+};
+
+#define GS_SEED                 2166136261U
+#define gs_step(h, c)           (((h) ^ (unsigned char)(c)) * 16777619U)
+
+/*
+ * Hash of a key. GS_BACK keys are hashed from their last character back, to
+ * match the way a name's suffixes are hashed.
+ */
+static uint32_t
+gs_hash(int kind, const char *s, size_t len)
+{
+  uint32_t h = GS_SEED ^ kind;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = gs_step(h, (GS_BACK == kind) ? s[len - 1 - i] : s[i]);
+  }
+
+  return h;
+}
+
+static void
+gs_add(globset_t *gs, int kind, const char *key, size_t klen, const char *tail, size_t tlen)
+{
+  gsent_t *ent;
+  uint32_t h = gs_hash(kind, key, klen);
+  size_t i = h & gs->mask;
+
+  while (gs->ents[i].key) {
+    i = (i + 1) & gs->mask;
+  }
+
+  ent = &gs->ents[i];
+  ent->key = key;
+  ent->klen = klen;
+  ent->tail = tail;
+  ent->tlen = tlen;
+  ent->hash = h;
+  ent->kind = kind;
+}
+
+globset_t *
+globset_new(const strlist_t *patterns, int flags)
+{
+  globset_t *gs = (globset_t *)calloc(1, sizeof(globset_t));
+  size_t slots = 16;
+  int i;
+
+  while (slots < 2 * (size_t)patterns->nstrs) {
+    slots <<= 1;
+  }
+  gs->ents = (gsent_t *)calloc(slots, sizeof(gsent_t));
+  gs->mask = slots - 1;
+  gs->flags = flags;
+  gs->slow = (const char **)malloc((patterns->strsz + 1) * sizeof(char *));
+  gs->all = patterns;
+
+  for (i = 0; i < patterns->strsz; i++) {
+    const char *p = patterns->strs[i], *star;
+
+    if (0 == p) {
+      continue;
+    }
+
+    star = strchr(p, '*');
+    if (strpbrk(p, "?[\\(") || (star && strchr(star + 1, '*'))) {
+      gs->slow[gs->nslow++] = p;
+    } else if (0 == star) {
+      gs_add(gs, GS_WHOLE, p, strlen(p), 0, 0);
+    } else if (star == p) {
+      if (star[1]) {
+        gs_add(gs, GS_BACK, star + 1, strlen(star + 1), 0, 0);
+      } else {
+        gs->anyname = 1;
+      }
+    } else {
+      gs_add(gs, GS_FRONT, p, star - p, star[1] ? star + 1 : 0, strlen(star + 1));
+    }
+  }
+
+  return gs;
+}
+
+/*
+ * Look for an entry of the given kind keyed on [s, s + len) that matches a
+ * name of nlen bytes.
+ */
+static int
+gs_probe(const globset_t *gs, int kind, uint32_t h, const char *s, size_t len, const char *name, size_t nlen)
+{
+  size_t i;
+
+  for (i = h & gs->mask; gs->ents[i].key; i = (i + 1) & gs->mask) {
+    const gsent_t *ent = &gs->ents[i];
+
+    if ((ent->hash != h) || (ent->kind != kind) || (ent->klen != len) || memcmp(ent->key, s, len)) {
+      continue;
+    }
+
+    if (0 == ent->tail) {
+      return 1;
+    }
+
+    if ((nlen >= len + ent->tlen) && (0 == memcmp(name + nlen - ent->tlen, ent->tail, ent->tlen))) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int
+globset_match(const globset_t *gs, const char *name)
+{
+  size_t nlen = strlen(name), i;
+  int lead_period = (name[0] == '.') && (gs->flags & FNM_PERIOD);
+  uint32_t h;
+
+  if (strchr(name, '/')) {
+    for (i = 0; i < (size_t)gs->all->strsz; i++) {
+      if (gs->all->strs[i] && (0 == fnmatch(gs->all->strs[i], name, gs->flags))) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  if (gs_probe(gs, GS_WHOLE, gs_hash(GS_WHOLE, name, nlen), name, nlen, name, nlen)) {
+    return 1;
+  }
+
+  /*
+   * A `*' at the start of a pattern can never match a leading period.
+   */
+  if (gs->anyname && !lead_period) {
+    return 1;
+  }
+
+  h = GS_SEED ^ GS_FRONT;
+  for (i = 1; i <= nlen; i++) {
+    h = gs_step(h, name[i - 1]);
+    if (gs_probe(gs, GS_FRONT, h, name, i, name, nlen)) {
+      return 1;
+    }
+  }
+
+  if (!lead_period) {
+    h = GS_SEED ^ GS_BACK;
+    for (i = 1; i <= nlen; i++) {
+      h = gs_step(h, name[nlen - i]);
+      if (gs_probe(gs, GS_BACK, h, name + nlen - i, i, name, nlen)) {
+        return 1;
+      }
+    }
+  }
+
+  for (i = 0; i < (size_t)gs->nslow; i++) {
+    if (0 == fnmatch(gs->slow[i], name, gs->flags)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void
+globset_free(globset_t *gs)
+{
+  if (gs) {
+    free(gs->ents);
+    free(gs->slow);
+    free(gs);
+  }
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
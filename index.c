@@ -0,0 +1,797 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "elfmod.h"
+
+/*
+ * The index (-X) records, for every file a run looked at, what -A would
+ * show for it, so that questions about a whole tree ("what needs
+ * libfoo.so.1?") can be answered (-Q) from the index alone without opening
+ * a single ELF file. Like the run cache it is mapped read-only for the run;
+ * files whose identity has not changed since it was written are carried
+ * over from it after a single statx(), everything else is looked at again,
+ * and a new index replaces the old one when the run finishes.
+ *
+ * Every string in it is stored once, in a table sorted by value so that a
+ * string can be found by binary search and referred to everywhere else by
+ * its position in the table. The file is laid out as:
+ *
+ *   emxhdr_t                   Header
+ *   emxent_t files[nfiles]     One per file, sorted by path
+ *   uint32_t needed[nneeded]   Each file's DT_NEEDED strings, in file order
+ *   uint32_t strs[nstrs]       Offset of each string in strtab, sorted
+ *   uint32_t poststart[nstrs + 1]
+ *   uint32_t posts[nposts]     Files needing each string, from poststart
+ *   uint32_t slots[nslots]     Open-addressed hash of paths: file + 1
+ *   char strtab[strtabsz]      The strings themselves, NUL terminated
+ */
+#define INDEX_MAGIC             "ELFMODX1"
+#define IX_NONE                 0xffffffffU
+
+#define IX_REJECTED             (1U << 0)       /* Not a file we process */
+
+typedef struct {
+  char magic[8];
+  uint32_t entsize;             /* sizeof(emxent_t), guards against format changes */
+  uint32_t nfiles;
+  uint32_t nstrs;
+  uint32_t nslots;              /* Always a power of 2 */
+  uint32_t nneeded;
+  uint32_t nposts;
+  uint64_t strtabsz;
+} emxhdr_t;
+
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime_ns;
+  uint32_t path;                /* The rest are strings, or IX_NONE */
+  uint32_t interp;
+  uint32_t soname;
+  uint32_t rpath;
+  uint32_t runpath;
+  uint32_t needed;              /* First of this file's entries in needed[] */
+  uint32_t nneeded;
+  uint32_t flags;               /* DT_FLAGS, with the old standalone tags folded in */
+  uint32_t flags_1;             /* DT_FLAGS_1 */
+  uint32_t status;              /* IX_xxx */
+} emxent_t;
+
+typedef struct {
+  emxhdr_t *hdr;
+  size_t maplen;
+  const emxent_t *files;
+  const uint32_t *needed;
+  const uint32_t *strs;
+  const uint32_t *poststart;
+  const uint32_t *posts;
+  const uint32_t *slots;
+  const char *strtab;
+} emxmap_t;
+
+static const char *xpath;
+static emxmap_t xold;           /* The index as the last run left it */
+static unsigned char *xkept;    /* Which of its files are unchanged */
+
+/*
+ * What this run has found. Strings are interned as they are recorded, into
+ * pool, and entries refer to them by the order they were first seen until
+ * index_close() sorts them.
+ */
+static pthread_mutex_t xlock = PTHREAD_MUTEX_INITIALIZER;
+static emxent_t *xents;
+static uint32_t nxents, xentsz;
+static uint32_t *xneeded;
+static uint32_t nxneeded, xneededsz;
+static char *pool;
+static size_t poollen, poolsz;
+static uint32_t *pooloff;       /* Where each interned string starts */
+static uint32_t npool, pooloffsz;
+static uint32_t *itab;          /* Hash of the strings: id + 1, 0 if empty */
+static uint32_t itabsz;
+
+static inline uint32_t
+str_hash(const char *s)
+{
+  uint32_t h = 2166136261U;
+
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+static inline uint32_t
+slots_for(uint32_t n)
+{
+  uint32_t nslots = 16;
+
+  while (nslots < 2 * n) {
+    nslots *= 2;
+  }
+
+  return nslots;
+}
+
+static void *
+grow(void *p, uint32_t *cap, uint32_t need, size_t elsize)
+{
+  if (need <= *cap) {
+    return p;
+  }
+
+  while (*cap < need) {
+    *cap = *cap ? *cap * 2 : 1024;
+  }
+
+  return realloc(p, *cap * elsize);
+}
+
+/*
+ * Return the id of str, adding it to the pool if it is not there yet, or
+ * IX_NONE for no string at all. Called with xlock held.
+ */
+static uint32_t
+intern(const char *str)
+{
+  uint32_t i, mask, id;
+  size_t sl;
+
+  if (0 == str) {
+    return IX_NONE;
+  }
+
+  if (2 * (npool + 1) > itabsz) {
+    free(itab);
+    itabsz = slots_for(npool + 1);
+    itab = (uint32_t *)calloc(itabsz, sizeof(uint32_t));
+    mask = itabsz - 1;
+    for (id = 0; id < npool; id++) {
+      i = str_hash(pool + pooloff[id]) & mask;
+      while (itab[i]) {
+        i = (i + 1) & mask;
+      }
+      itab[i] = id + 1;
+    }
+  }
+
+  mask = itabsz - 1;
+  i = str_hash(str) & mask;
+  while (itab[i]) {
+    if (0 == strcmp(pool + pooloff[itab[i] - 1], str)) {
+      return itab[i] - 1;
+    }
+    i = (i + 1) & mask;
+  }
+
+  sl = strlen(str) + 1;
+  if (poollen + sl > poolsz) {
+    while (poollen + sl > poolsz) {
+      poolsz = poolsz ? poolsz * 2 : 65536;
+    }
+    pool = (char *)realloc(pool, poolsz);
+  }
+  memcpy(pool + poollen, str, sl);
+
+  pooloff = (uint32_t *)grow(pooloff, &pooloffsz, npool + 1, sizeof(uint32_t));
+  pooloff[npool] = (uint32_t)poollen;
+  poollen += sl;
+  itab[i] = npool + 1;
+
+  return npool++;
+}
+
+/*
+ * String id of an index, as a C string. Damaged ids give an empty string.
+ */
+static const char *
+ix_str(const emxmap_t *m, uint32_t id)
+{
+  if ((id >= m->hdr->nstrs) || (m->strs[id] >= m->hdr->strtabsz)) {
+    return "";
+  }
+
+  return m->strtab + m->strs[id];
+}
+
+static const char *
+ix_optstr(const emxmap_t *m, uint32_t id)
+{
+  return (IX_NONE == id) ? 0 : ix_str(m, id);
+}
+
+/*
+ * Map an index file. A missing file is not an error unless must is set, and
+ * a damaged one is only an error if must is set.
+ */
+static int
+index_map(const char *path, emxmap_t *m, int must)
+{
+  struct stat sb;
+  emxhdr_t *h;
+  uint64_t need;
+  int fd;
+
+  memset(m, 0, sizeof(*m));
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if ((ENOENT == errno) && !must) {
+      return 0;
+    }
+    fprintf(stderr, "%s error: could not open index `%s': %s\n", progname, path, strerror(errno));
+    return 1;
+  }
+
+  if ((fstat(fd, &sb) < 0) || ((size_t)sb.st_size < sizeof(emxhdr_t))) {
+    close(fd);
+    goto damaged;
+  }
+
+  h = (emxhdr_t *)mmap(0, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == h) {
+    goto damaged;
+  }
+
+  need = sizeof(emxhdr_t) + (uint64_t)h->nfiles * sizeof(emxent_t) +
+    ((uint64_t)h->nneeded + h->nstrs + h->nstrs + 1 + h->nposts + h->nslots) * sizeof(uint32_t) + h->strtabsz;
+  if (memcmp(h->magic, INDEX_MAGIC, 8) || (h->entsize != sizeof(emxent_t)) ||
+      (0 == h->nslots) || (h->nslots & (h->nslots - 1)) || ((uint64_t)sb.st_size != need)) {
+    munmap(h, sb.st_size);
+    goto damaged;
+  }
+
+  m->hdr = h;
+  m->maplen = sb.st_size;
+  m->files = (const emxent_t *)(h + 1);
+  m->needed = (const uint32_t *)(m->files + h->nfiles);
+  m->strs = m->needed + h->nneeded;
+  m->poststart = m->strs + h->nstrs;
+  m->posts = m->poststart + h->nstrs + 1;
+  m->slots = m->posts + h->nposts;
+  m->strtab = (const char *)(m->slots + h->nslots);
+
+  return 0;
+
+damaged:
+  if (must) {
+    fprintf(stderr, "%s error: `%s' is not a usable index\n", progname, path);
+    return 1;
+  }
+  fprintf(stderr, "%s warning: ignoring damaged index `%s'\n", progname, path);
+  return 0;
+}
+
+static void
+index_unmap(emxmap_t *m)
+{
+  if (m->hdr) {
+    munmap(m->hdr, m->maplen);
+  }
+  memset(m, 0, sizeof(*m));
+}
+
+/*
+ * Return the file in m with the given path, or IX_NONE.
+ */
+static uint32_t
+index_find(const emxmap_t *m, const char *path)
+{
+  uint32_t mask, i, n;
+
+  if (0 == m->hdr) {
+    return IX_NONE;
+  }
+
+  mask = m->hdr->nslots - 1;
+  i = str_hash(path) & mask;
+  for (n = 0; (n < m->hdr->nslots) && m->slots[i]; n++) {
+    if ((m->slots[i] <= m->hdr->nfiles) && (0 == strcmp(ix_str(m, m->files[m->slots[i] - 1].path), path))) {
+      return m->slots[i] - 1;
+    }
+    i = (i + 1) & mask;
+  }
+
+  return IX_NONE;
+}
+
+int
+index_open(const emopts_t *opts)
+{
+  xpath = opts->indexfile;
+
+  if (index_map(xpath, &xold, 0)) {
+    return 1;
+  }
+
+  if (xold.hdr) {
+    xkept = (unsigned char *)calloc(xold.hdr->nfiles + 1, 1);
+  }
+
+  return 0;
+}
+
+/*
+ * Returns non-zero if path is in the index, unchanged since it was written,
+ * in which case it is carried over into the new one as it is.
+ */
+int
+index_lookup(const char *path, const emfid_t *id)
+{
+  const emxent_t *xe;
+  uint32_t fi = index_find(&xold, path);
+
+  if (IX_NONE == fi) {
+    return 0;
+  }
+
+  xe = &xold.files[fi];
+  if ((xe->dev != id->dev) || (xe->ino != id->ino) || (xe->size != id->size) || (xe->mtime_ns != id->mtime_ns)) {
+    return 0;
+  }
+
+  __atomic_store_n(&xkept[fi], 1, __ATOMIC_RELAXED);
+  emstat_add(cached, 1);
+  return 1;
+}
+
+/*
+ * Add an entry for a file. Called with xlock held.
+ */
+static void
+index_add(const emfid_t *id, const char *path, const emxinfo_t *xi, uint32_t status)
+{
+  emxent_t *xe;
+  uint32_t i;
+
+  xents = (emxent_t *)grow(xents, &xentsz, nxents + 1, sizeof(emxent_t));
+  xe = &xents[nxents++];
+  memset(xe, 0, sizeof(*xe));
+  xe->dev = id->dev;
+  xe->ino = id->ino;
+  xe->size = id->size;
+  xe->mtime_ns = id->mtime_ns;
+  xe->path = intern(path);
+  xe->status = status;
+  xe->interp = xe->soname = xe->rpath = xe->runpath = IX_NONE;
+  xe->needed = nxneeded;
+
+  if (xi) {
+    xe->interp = intern(xi->interp);
+    xe->soname = intern(xi->soname);
+    xe->rpath = intern(xi->rpath);
+    xe->runpath = intern(xi->runpath);
+    xe->flags = xi->flags;
+    xe->flags_1 = xi->flags_1;
+    xe->status |= xi->status;
+    xneeded = (uint32_t *)grow(xneeded, &xneededsz, nxneeded + xi->nneeded, sizeof(uint32_t));
+    for (i = 0; i < xi->nneeded; i++) {
+      xneeded[nxneeded++] = intern(xi->needed[i]);
+    }
+    xe->nneeded = xi->nneeded;
+  }
+}
+
+/*
+ * Note what was found in the file just looked at: ctx->xinfo if it was
+ * processed, or that it is not a file we process.
+ */
+void
+index_record(emctx_t *ctx, const emfid_t *id)
+{
+  if (0 == xpath) {
+    return;
+  }
+
+  pthread_mutex_lock(&xlock);
+  index_add(id, ctx->curfile, ctx->xinfo, ctx->xinfo ? 0 : IX_REJECTED);
+  pthread_mutex_unlock(&xlock);
+}
+
+static const char *sort_pool;
+static const uint32_t *sort_off;
+
+static int
+cmp_strid(const void *a, const void *b)
+{
+  return strcmp(sort_pool + sort_off[*(const uint32_t *)a], sort_pool + sort_off[*(const uint32_t *)b]);
+}
+
+static int
+cmp_path(const void *a, const void *b)
+{
+  const emxent_t *ea = (const emxent_t *)a, *eb = (const emxent_t *)b;
+
+  return (ea->path > eb->path) - (ea->path < eb->path);
+}
+
+static inline uint32_t
+remap(const uint32_t *rank, uint32_t id)
+{
+  return (IX_NONE == id) ? IX_NONE : rank[id];
+}
+
+/*
+ * Write the new index: the files looked at in this run, and those carried
+ * over from the old index unchanged. Anything in the old index that this
+ * run did not come across is dropped. The new index atomically replaces the
+ * old one.
+ */
+int
+index_close(void)
+{
+  emxhdr_t nh;
+  emxent_t *xe;
+  uint32_t *order = 0, *rank = 0, *strs = 0, *needed = 0, *poststart = 0, *posts = 0, *slots = 0, *last = 0;
+  uint32_t fi, i, k, n, nfiles, mask;
+  uint64_t off;
+  char *tmpname;
+  size_t tl;
+  FILE *fp;
+  int ok = 0, ret = 0;
+
+  if (0 == xpath) {
+    return 0;
+  }
+
+  /*
+   * Carry over the unchanged files. Their strings are interned along with
+   * everyone else's.
+   */
+  for (fi = 0; xold.hdr && (fi < xold.hdr->nfiles); fi++) {
+    const emxent_t *oe = &xold.files[fi];
+    emxinfo_t xi;
+    emfid_t id;
+    const char *nbuf[64], **nv = nbuf;
+
+    if (0 == xkept[fi]) {
+      continue;
+    }
+
+    memset(&id, 0, sizeof(id));
+    id.dev = oe->dev;
+    id.ino = oe->ino;
+    id.size = oe->size;
+    id.mtime_ns = oe->mtime_ns;
+
+    memset(&xi, 0, sizeof(xi));
+    xi.interp = ix_optstr(&xold, oe->interp);
+    xi.soname = ix_optstr(&xold, oe->soname);
+    xi.rpath = ix_optstr(&xold, oe->rpath);
+    xi.runpath = ix_optstr(&xold, oe->runpath);
+    xi.flags = oe->flags;
+    xi.flags_1 = oe->flags_1;
+    if ((oe->needed <= xold.hdr->nneeded) && (oe->nneeded <= xold.hdr->nneeded - oe->needed)) {
+      xi.nneeded = oe->nneeded;
+    }
+    if (xi.nneeded > 64) {
+      nv = (const char **)malloc(xi.nneeded * sizeof(char *));
+    }
+    for (i = 0; i < xi.nneeded; i++) {
+      nv[i] = ix_str(&xold, xold.needed[oe->needed + i]);
+    }
+    xi.needed = nv;
+    index_add(&id, ix_str(&xold, oe->path), &xi, oe->status);
+    if (nv != nbuf) {
+      free(nv);
+    }
+  }
+
+  /*
+   * Sort the strings, and rank each by where it ended up.
+   */
+  order = (uint32_t *)malloc((npool + 1) * sizeof(uint32_t));
+  rank = (uint32_t *)malloc((npool + 1) * sizeof(uint32_t));
+  strs = (uint32_t *)malloc((npool + 1) * sizeof(uint32_t));
+  for (i = 0; i < npool; i++) {
+    order[i] = i;
+  }
+  sort_pool = pool;
+  sort_off = pooloff;
+  qsort(order, npool, sizeof(uint32_t), cmp_strid);
+
+  memset(&nh, 0, sizeof(nh));
+  for (i = 0; i < npool; i++) {
+    rank[order[i]] = i;
+    strs[i] = (uint32_t)nh.strtabsz;
+    nh.strtabsz += strlen(pool + pooloff[order[i]]) + 1;
+  }
+
+  /*
+   * Renumber every string, sort the files by path and drop any path that
+   * was given more than once.
+   */
+  for (i = 0; i < nxents; i++) {
+    xe = &xents[i];
+    xe->path = remap(rank, xe->path);
+    xe->interp = remap(rank, xe->interp);
+    xe->soname = remap(rank, xe->soname);
+    xe->rpath = remap(rank, xe->rpath);
+    xe->runpath = remap(rank, xe->runpath);
+  }
+  for (i = 0; i < nxneeded; i++) {
+    xneeded[i] = rank[xneeded[i]];
+  }
+  qsort(xents, nxents, sizeof(emxent_t), cmp_path);
+
+  for (nfiles = 0, i = 0; i < nxents; i++) {
+    if ((0 == nfiles) || (xents[nfiles - 1].path != xents[i].path)) {
+      xents[nfiles++] = xents[i];
+    }
+  }
+
+  /*
+   * Lay the needed lists out in file order, and build the posting lists
+   * from them, counting each file once per string.
+   */
+  needed = (uint32_t *)malloc((nxneeded + 1) * sizeof(uint32_t));
+  poststart = (uint32_t *)calloc(npool + 1, sizeof(uint32_t));
+  last = (uint32_t *)malloc((npool + 1) * sizeof(uint32_t));
+  memset(last, 0xff, (npool + 1) * sizeof(uint32_t));
+  for (n = 0, fi = 0; fi < nfiles; fi++) {
+    xe = &xents[fi];
+    memmove(needed + n, xneeded + xe->needed, xe->nneeded * sizeof(uint32_t));
+    xe->needed = n;
+    for (k = 0; k < xe->nneeded; k++, n++) {
+      if (last[needed[n]] != fi) {
+        last[needed[n]] = fi;
+        poststart[needed[n]]++;
+        nh.nposts++;
+      }
+    }
+  }
+  nh.nneeded = n;
+
+  for (off = 0, i = 0; i <= npool; i++) {
+    k = poststart[i];
+    poststart[i] = (uint32_t)off;
+    off += k;
+  }
+  posts = (uint32_t *)malloc((nh.nposts + 1) * sizeof(uint32_t));
+  memset(last, 0xff, (npool + 1) * sizeof(uint32_t));
+  for (fi = 0; fi < nfiles; fi++) {
+    xe = &xents[fi];
+    for (k = 0; k < xe->nneeded; k++) {
+      i = needed[xe->needed + k];
+      if (last[i] != fi) {
+        last[i] = fi;
+        posts[poststart[i]++] = fi;
+      }
+    }
+  }
+  for (i = npool; i > 0; i--) {
+    poststart[i] = poststart[i - 1];
+  }
+  poststart[0] = 0;
+
+  nh.nslots = slots_for(nfiles);
+  slots = (uint32_t *)calloc(nh.nslots, sizeof(uint32_t));
+  mask = nh.nslots - 1;
+  for (fi = 0; fi < nfiles; fi++) {
+    i = str_hash(pool + pooloff[order[xents[fi].path]]) & mask;
+    while (slots[i]) {
+      i = (i + 1) & mask;
+    }
+    slots[i] = fi + 1;
+  }
+
+  memcpy(nh.magic, INDEX_MAGIC, 8);
+  nh.entsize = sizeof(emxent_t);
+  nh.nfiles = nfiles;
+  nh.nstrs = npool;
+
+  tl = strlen(xpath) + 16;
+  tmpname = (char *)malloc(tl);
+  snprintf(tmpname, tl, "%s.%ld", xpath, (long)getpid());
+
+  fp = fopen(tmpname, "w");
+  if (fp) {
+    ok = (fwrite(&nh, sizeof(nh), 1, fp) == 1) &&
+      (fwrite(xents, sizeof(emxent_t), nfiles, fp) == nfiles) &&
+      (fwrite(needed, sizeof(uint32_t), nh.nneeded, fp) == nh.nneeded) &&
+      (fwrite(strs, sizeof(uint32_t), npool, fp) == npool) &&
+      (fwrite(poststart, sizeof(uint32_t), npool + 1, fp) == npool + 1) &&
+      (fwrite(posts, sizeof(uint32_t), nh.nposts, fp) == nh.nposts) &&
+      (fwrite(slots, sizeof(uint32_t), nh.nslots, fp) == nh.nslots);
+    for (i = 0; ok && (i < npool); i++) {
+      const char *s = pool + pooloff[order[i]];
+
+      ok = (fwrite(s, 1, strlen(s) + 1, fp) == strlen(s) + 1);
+    }
+    if (fclose(fp)) {
+      ok = 0;
+    }
+  }
+
+  if ((0 == ok) || rename(tmpname, xpath)) {
+    fprintf(stderr, "%s error: could not write index `%s': %s\n", progname, xpath, strerror(errno));
+    unlink(tmpname);
+    ret = 1;
+  }
+
+  free(tmpname);
+  free(order);
+  free(rank);
+  free(strs);
+  free(needed);
+  free(poststart);
+  free(posts);
+  free(last);
+  free(slots);
+
+  index_unmap(&xold);
+  free(xkept);
+  free(xents);
+  free(xneeded);
+  free(pool);
+  free(pooloff);
+  free(itab);
+  xkept = 0;
+  xents = 0;
+  xneeded = 0;
+  pool = 0;
+  pooloff = 0;
+  itab = 0;
+  nxents = xentsz = nxneeded = xneededsz = npool = pooloffsz = itabsz = 0;
+  poollen = poolsz = 0;
+  xpath = 0;
+
+  return ret;
+}
+
+/*
+ * Return the id of str in the index, or IX_NONE if it is not there.
+ */
+static uint32_t
+index_strid(const emxmap_t *m, const char *str)
+{
+  uint32_t lo = 0, hi = m->hdr->nstrs, mid;
+  int c;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    c = strcmp(ix_str(m, mid), str);
+    if (0 == c) {
+      return mid;
+    }
+    if (c < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return IX_NONE;
+}
+
+/*
+ * Answer a query from the index, printing the path of every file that
+ * matches, one per line, in order. A query is one of interp, soname, rpath,
+ * runpath or needed, optionally followed by =value, or origin. Without a
+ * value it matches every file that has any such entry; with one, only those
+ * with that exact value. needed=value is answered from the posting list of
+ * value without looking at any other file.
+ */
+int
+index_query(const char *indexfile, const char *query, FILE *out)
+{
+  static const char *const keys[] = { "interp", "soname", "rpath", "runpath", "needed", "origin", 0 };
+  emxmap_t m;
+  const char *eq = strchr(query, '=');
+  size_t kl = eq ? (size_t)(eq - query) : strlen(query);
+  uint32_t fi, sid = IX_NONE, v;
+  int key;
+
+  for (key = 0; keys[key]; key++) {
+    if ((strlen(keys[key]) == kl) && (0 == strncmp(keys[key], query, kl))) {
+      break;
+    }
+  }
+  if ((0 == keys[key]) || (eq && (5 == key))) {
+    fprintf(stderr, "%s: unknown index query `%s'. See %s -H for usage.\n", progname, query, progname);
+    return 1;
+  }
+
+  if (index_map(indexfile, &m, 1)) {
+    return 1;
+  }
+
+  if (eq) {
+    sid = index_strid(&m, eq + 1);
+    if (IX_NONE == sid) {
+      index_unmap(&m);
+      return 0;
+    }
+  }
+
+  if ((4 == key) && eq) {
+    if (sid < m.hdr->nstrs) {
+      for (v = m.poststart[sid]; (v < m.poststart[sid + 1]) && (v < m.hdr->nposts); v++) {
+        if (m.posts[v] < m.hdr->nfiles) {
+          fprintf(out, "%s\n", ix_str(&m, m.files[m.posts[v]].path));
+        }
+      }
+    }
+    index_unmap(&m);
+    return 0;
+  }
+
+  for (fi = 0; fi < m.hdr->nfiles; fi++) {
+    const emxent_t *xe = &m.files[fi];
+
+    if (xe->status & IX_REJECTED) {
+      continue;
+    }
+
+    switch (key) {
+      case 0:
+        v = xe->interp;
+        break;
+      case 1:
+        v = xe->soname;
+        break;
+      case 2:
+        v = xe->rpath;
+        break;
+      case 3:
+        v = xe->runpath;
+        break;
+      case 4:
+        v = xe->nneeded ? 0 : IX_NONE;
+        break;
+      default:
+        v = (xe->status & IX_ORIGIN) ? 0 : IX_NONE;
+        break;
+    }
+
+    if ((IX_NONE != v) && (!eq || (v == sid))) {
+      fprintf(out, "%s\n", ix_str(&m, xe->path));
+    }
+  }
+
+  index_unmap(&m);
+  return 0;
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
@@ -0,0 +1,152 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "outbuf.h"
+
+/*
+ * Every byte as two hex digits, and every number below 100 as two decimal
+ * ones, so that numbers are converted two digits at a time.
+ */
+static const char hexpairs[] =
+  "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+  "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+  "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+  "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+  "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+  "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+  "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+  "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static const char decpairs[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+void
+ob_flush(emobuf_t *ob)
+{
+  if (ob->len) {
+    fwrite(ob->buf, 1, ob->len, ob->fp);
+    ob->len = 0;
+  }
+}
+
+/*
+ * The slow path of ob_write(), for when s does not fit in what is left of
+ * the buffer. Anything as big as the buffer itself goes straight to stdio.
+ */
+void
+ob_spill(emobuf_t *ob, const char *s, size_t n)
+{
+  ob_flush(ob);
+  if (n >= OUTBUF_SIZE) {
+    fwrite(s, 1, n, ob->fp);
+    return;
+  }
+
+  memcpy(ob->buf, s, n);
+  ob->len = n;
+}
+
+/*
+ * Print v as printf("0x%0*" PRIx64, width, v) would, for a width of no more
+ * than 16.
+ */
+void
+ob_hex(emobuf_t *ob, uint64_t v, int width)
+{
+  char tmp[18], *p = tmp + sizeof(tmp);
+  int n = 0;
+
+  do {
+    p -= 2;
+    memcpy(p, &hexpairs[2 * (v & 0xff)], 2);
+    v >>= 8;
+    n += 2;
+  } while (v);
+
+  if ((n > 1) && ('0' == *p) && (n > width)) {
+    p++;
+    n--;
+  }
+  while (n < width) {
+    *--p = '0';
+    n++;
+  }
+  *--p = 'x';
+  *--p = '0';
+
+  ob_write(ob, p, n + 2);
+}
+
+/*
+ * Print v as printf("%" PRIu64, v) would.
+ */
+void
+ob_dec(emobuf_t *ob, uint64_t v)
+{
+  char tmp[20], *p = tmp + sizeof(tmp);
+
+  while (v >= 100) {
+    p -= 2;
+    memcpy(p, &decpairs[2 * (v % 100)], 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    p -= 2;
+    memcpy(p, &decpairs[2 * v], 2);
+  } else {
+    *--p = (char)('0' + v);
+  }
+
+  ob_write(ob, p, tmp + sizeof(tmp) - p);
+}
+
+/*
+ * Print s left justified in a field of width, as printf("%-*s") would.
+ */
+void
+ob_pad(emobuf_t *ob, const char *s, size_t width)
+{
+  static const char spaces[] = "                                ";
+  size_t n = strlen(s);
+
+  ob_write(ob, s, n);
+  while (n < width) {
+    size_t k = width - n;
+
+    if (k > sizeof(spaces) - 1) {
+      k = sizeof(spaces) - 1;
+    }
+    ob_write(ob, spaces, k);
+    n += k;
+  }
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
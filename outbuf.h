@@ -0,0 +1,110 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef ELFMOD_OUTBUF_H
+#define ELFMOD_OUTBUF_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * An output buffer for the display code, which writes a great many short
+ * pieces of text. They are copied into buf and given to stdio a buffer at a
+ * time, and numbers are formatted from tables rather than by parsing printf
+ * formats for every field. An emobuf_t lives on the stack of whoever is
+ * displaying, so each thread has its own. Anything else written to fp in the
+ * meantime (prettyhex(), say) must be preceded by ob_flush().
+ */
+#define OUTBUF_SIZE             8192
+
+typedef struct {
+  FILE *fp;
+  size_t len;
+  char buf[OUTBUF_SIZE];
+} emobuf_t;
+
+extern void ob_flush(emobuf_t *ob);
+extern void ob_spill(emobuf_t *ob, const char *s, size_t n);
+extern void ob_hex(emobuf_t *ob, uint64_t v, int width);
+extern void ob_dec(emobuf_t *ob, uint64_t v);
+extern void ob_pad(emobuf_t *ob, const char *s, size_t width);
+
+static inline void
+ob_init(emobuf_t *ob, FILE *fp)
+{
+  ob->fp = fp;
+  ob->len = 0;
+}
+
+static inline void
+ob_write(emobuf_t *ob, const char *s, size_t n)
+{
+  if (ob->len + n > OUTBUF_SIZE) {
+    ob_spill(ob, s, n);
+    return;
+  }
+
+  memcpy(ob->buf + ob->len, s, n);
+  ob->len += n;
+}
+
+static inline void
+ob_puts(emobuf_t *ob, const char *s)
+{
+  ob_write(ob, s, strlen(s));
+}
+
+static inline void
+ob_putc(emobuf_t *ob, int c)
+{
+  if (ob->len == OUTBUF_SIZE) {
+    ob_flush(ob);
+  }
+
+  ob->buf[ob->len++] = (char)c;
+}
+
+/*
+ * Print v followed by " what", and an "s" after that unless v is 1, as the
+ * plural() macro does for printf().
+ */
+static inline void
+ob_count(emobuf_t *ob, uint64_t v, const char *what)
+{
+  ob_dec(ob, v);
+  ob_putc(ob, ' ');
+  ob_puts(ob, what);
+  if (1 != v) {
+    ob_putc(ob, 's');
+  }
+}
+
+#endif /* ELFMOD_OUTBUF_H */
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
@@ -26,6 +26,7 @@
 #ifndef ELFMOD_PRETTYHEX_H
 #define ELFMOD_PRETTYHEX_H
 
+#include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -37,7 +38,7 @@
 #define HPP_ASCII_ONLY      (1 << 5)    /* Only print ASCII dump */
 #define HPP_LEAD_FIRST      (1 << 6)    /* Print leader first time around otherwise don't */
 
-extern void prettyhex(const unsigned char *data, size_t len, uint32_t offs, uint32_t flags, const char *leader);
+extern void prettyhex(FILE *fp, const unsigned char *data, size_t len, uint32_t offs, uint32_t flags, const char *leader);
 
 #endif /* ELFMOD_PRETTYHEX_H */
 
@@ -29,24 +29,42 @@
  * realproc.inc. See the comment at the top of that file.
  */
 
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 #include "elfmod.h"
 #include "prettyhex.h"
+#include "outbuf.h"
+#include "record.h"
 
 typedef Elf32_Ehdr Elf_Ehdr;
 typedef Elf32_Phdr Elf_Phdr;
 typedef Elf32_Shdr Elf_Shdr;
 typedef Elf32_Dyn Elf_Dyn;
+typedef Elf32_Sym Elf_Sym;
+typedef Elf32_Verdef Elf_Verdef;
+typedef Elf32_Verdaux Elf_Verdaux;
+typedef Elf32_Verneed Elf_Verneed;
+typedef Elf32_Vernaux Elf_Vernaux;
 typedef int32_t ecint_t;
 typedef uint32_t ecuint_t;
 
 #define ELFCS           "32"
+#define EXDIGITS        8
 #define PRIex           "0x%08" PRIx32
 #define PRI8x           "0x%08" PRIx32
 #define PRIeu           "%" PRIu32
 #define PRIei           "%" PRIi32
 #define EXSPACES        ""
 
+#ifdef EM_SWAPPED
+#define process_file    process_file_32x
+#define triage_file     triage_file_32x
+#else
 #define process_file    process_file_32
+#define triage_file     triage_file_32
+#endif
 
 #include "realproc.inc"
 
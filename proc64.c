@@ -29,24 +29,42 @@
  * realproc.inc. See the comment at the top of that file.
  */
 
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 #include "elfmod.h"
 #include "prettyhex.h"
+#include "outbuf.h"
+#include "record.h"
 
 typedef Elf64_Ehdr Elf_Ehdr;
 typedef Elf64_Phdr Elf_Phdr;
 typedef Elf64_Shdr Elf_Shdr;
 typedef Elf64_Dyn Elf_Dyn;
+typedef Elf64_Sym Elf_Sym;
+typedef Elf64_Verdef Elf_Verdef;
+typedef Elf64_Verdaux Elf_Verdaux;
+typedef Elf64_Verneed Elf_Verneed;
+typedef Elf64_Vernaux Elf_Vernaux;
 typedef int64_t ecint_t;
 typedef uint64_t ecuint_t;
 
 #define ELFCS           "64"
+#define EXDIGITS        16
 #define PRIex           "0x%016" PRIx64
 #define PRI8x           "0x%08" PRIx64
 #define PRIeu           "%" PRIu64
 #define PRIei           "%" PRIi64
 #define EXSPACES        "        "
 
+#ifdef EM_SWAPPED
+#define process_file    process_file_64x
+#define triage_file     triage_file_64x
+#else
 #define process_file    process_file_64
+#define triage_file     triage_file_64
+#endif
 
 #include "realproc.inc"
 
@@ -27,17 +27,37 @@
 #include "elfmod.h"
 
 /*
- * Dispatch to the correct class-specific processor. By the time we get here
- * the caller has already verified the ELF magic and that EI_CLASS is one of
- * ELFCLASS32 or ELFCLASS64.
+ * Dispatch to the correct class and byte order specific processor. By the
+ * time we get here the caller has already verified the ELF magic, that
+ * EI_CLASS is one of ELFCLASS32 or ELFCLASS64 and that EI_DATA is one of
+ * ELFDATA2LSB or ELFDATA2MSB.
  */
 int
-process_file(unsigned char *data, size_t dlen)
+process_file(emctx_t *ctx, emfmap_t *map)
 {
-  if (data[EI_CLASS] == ELFCLASS32) {
-    return process_file_32(data, dlen);
+  const unsigned char *ident = (const unsigned char *)fmap_get(map, 0, EI_NIDENT);
+  int swapped;
+
+  if (0 == ident) {
+    return 1;
+  }
+
+  swapped = (ident[EI_DATA] != ELFDATA_HOST);
+  if (ident[EI_CLASS] == ELFCLASS32) {
+    return swapped ? process_file_32x(ctx, map) : process_file_32(ctx, map);
+  }
+  return swapped ? process_file_64x(ctx, map) : process_file_64(ctx, map);
+}
+
+int
+triage_file(emctx_t *ctx, int fd, size_t flen, const unsigned char *hdr, size_t hlen)
+{
+  int swapped = (hdr[EI_DATA] != ELFDATA_HOST);
+
+  if (hdr[EI_CLASS] == ELFCLASS32) {
+    return swapped ? triage_file_32x(ctx, fd, flen, hdr, hlen) : triage_file_32(ctx, fd, flen, hdr, hlen);
   }
-  return process_file_64(data, dlen);
+  return swapped ? triage_file_64x(ctx, fd, flen, hdr, hlen) : triage_file_64(ctx, fd, flen, hdr, hlen);
 }
 
 /*
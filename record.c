@@ -0,0 +1,279 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "record.h"
+
+#define CBOR_UINT               0
+#define CBOR_BYTES              2
+#define CBOR_TEXT               3
+#define CBOR_FALSE              0xf4
+#define CBOR_TRUE               0xf5
+#define CBOR_ARRAY_START        0x9f
+#define CBOR_MAP_START          0xbf
+#define CBOR_BREAK              0xff
+
+void
+rec_init(emrec_t *r, emobuf_t *ob, int format)
+{
+  r->ob = ob;
+  r->format = format;
+  r->depth = 0;
+  r->count[0] = 0;
+}
+
+/*
+ * Write a CBOR major type and its argument in the shortest form.
+ */
+static void
+cbor_head(emobuf_t *ob, int major, uint64_t v)
+{
+  unsigned char buf[9];
+  int n, i;
+
+  if (v < 24) {
+    ob_putc(ob, (major << 5) | (int)v);
+    return;
+  }
+
+  if (v <= 0xff) {
+    n = 1;
+    buf[0] = (unsigned char)((major << 5) | 24);
+  } else if (v <= 0xffff) {
+    n = 2;
+    buf[0] = (unsigned char)((major << 5) | 25);
+  } else if (v <= 0xffffffffULL) {
+    n = 4;
+    buf[0] = (unsigned char)((major << 5) | 26);
+  } else {
+    n = 8;
+    buf[0] = (unsigned char)((major << 5) | 27);
+  }
+
+  for (i = n; i > 0; i--) {
+    buf[i] = (unsigned char)(v & 0xff);
+    v >>= 8;
+  }
+
+  ob_write(ob, (const char *)buf, n + 1);
+}
+
+/*
+ * Return the length of the UTF-8 sequence starting at p, or 0 if it is not
+ * a valid one. Overlong forms, surrogates and values past U+10FFFF are not
+ * valid.
+ */
+static int
+utf8_len(const unsigned char *p)
+{
+  int n, i;
+  uint32_t c;
+
+  if (p[0] < 0x80) {
+    return 1;
+  } else if ((p[0] & 0xe0) == 0xc0) {
+    n = 2;
+    c = p[0] & 0x1f;
+  } else if ((p[0] & 0xf0) == 0xe0) {
+    n = 3;
+    c = p[0] & 0x0f;
+  } else if ((p[0] & 0xf8) == 0xf0) {
+    n = 4;
+    c = p[0] & 0x07;
+  } else {
+    return 0;
+  }
+
+  for (i = 1; i < n; i++) {
+    if ((p[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    c = (c << 6) | (p[i] & 0x3f);
+  }
+
+  if (((2 == n) && (c < 0x80)) || ((3 == n) && (c < 0x800)) || ((4 == n) && (c < 0x10000)) ||
+      ((c >= 0xd800) && (c <= 0xdfff)) || (c > 0x10ffff)) {
+    return 0;
+  }
+
+  return n;
+}
+
+static void
+json_str(emobuf_t *ob, const char *s)
+{
+  const unsigned char *p = (const unsigned char *)s;
+  const unsigned char *run = p;
+  int n;
+
+  ob_putc(ob, '"');
+  while (*p) {
+    if ((*p >= 0x20) && (*p != 0x7f) && (*p != '"') && (*p != '\\') && ((n = utf8_len(p)) > 0)) {
+      p += n;
+      continue;
+    }
+
+    ob_write(ob, (const char *)run, p - run);
+    if (('"' == *p) || ('\\' == *p)) {
+      ob_putc(ob, '\\');
+      ob_putc(ob, *p);
+    } else {
+      ob_puts(ob, "\\u00");
+      ob_putc(ob, "0123456789abcdef"[*p >> 4]);
+      ob_putc(ob, "0123456789abcdef"[*p & 0xf]);
+    }
+    p++;
+    run = p;
+  }
+  ob_write(ob, (const char *)run, p - run);
+  ob_putc(ob, '"');
+}
+
+static void
+cbor_str(emobuf_t *ob, const char *s)
+{
+  const unsigned char *p = (const unsigned char *)s;
+  size_t len = strlen(s);
+  int major = CBOR_TEXT, n;
+
+  while (*p) {
+    if (0 == (n = utf8_len(p))) {
+      major = CBOR_BYTES;
+      break;
+    }
+    p += n;
+  }
+
+  cbor_head(ob, major, len);
+  ob_write(ob, s, len);
+}
+
+/*
+ * Start a value: the separator from the one before it and, inside a map,
+ * its key.
+ */
+static void
+rec_key(emrec_t *r, const char *key)
+{
+  if (REC_JSONL == r->format) {
+    if (r->count[r->depth]++) {
+      ob_putc(r->ob, ',');
+    }
+    if (key) {
+      json_str(r->ob, key);
+      ob_putc(r->ob, ':');
+    }
+  } else if (key) {
+    cbor_str(r->ob, key);
+  }
+}
+
+static void
+rec_open(emrec_t *r, const char *key, int json, int cbor)
+{
+  rec_key(r, key);
+  if (REC_JSONL == r->format) {
+    ob_putc(r->ob, json);
+  } else {
+    ob_putc(r->ob, cbor);
+  }
+
+  r->depth++;
+  r->count[r->depth] = 0;
+  if (REC_JSONL == r->format) {
+    r->close[r->depth] = ('{' == json) ? '}' : ']';
+  } else {
+    r->close[r->depth] = (char)CBOR_BREAK;
+  }
+}
+
+/*
+ * Start a map or an array. Records are never nested more than
+ * REC_MAXDEPTH - 1 deep.
+ */
+void
+rec_map(emrec_t *r, const char *key)
+{
+  rec_open(r, key, '{', CBOR_MAP_START);
+}
+
+void
+rec_array(emrec_t *r, const char *key)
+{
+  rec_open(r, key, '[', CBOR_ARRAY_START);
+}
+
+/*
+ * Close the innermost map or array. Closing the record itself ends the line
+ * for JSON.
+ */
+void
+rec_end(emrec_t *r)
+{
+  ob_putc(r->ob, r->close[r->depth]);
+  r->depth--;
+
+  if ((0 == r->depth) && (REC_JSONL == r->format)) {
+    ob_putc(r->ob, '\n');
+  }
+}
+
+void
+rec_uint(emrec_t *r, const char *key, uint64_t v)
+{
+  rec_key(r, key);
+  if (REC_JSONL == r->format) {
+    ob_dec(r->ob, v);
+  } else {
+    cbor_head(r->ob, CBOR_UINT, v);
+  }
+}
+
+void
+rec_bool(emrec_t *r, const char *key, int v)
+{
+  rec_key(r, key);
+  if (REC_JSONL == r->format) {
+    ob_puts(r->ob, v ? "true" : "false");
+  } else {
+    ob_putc(r->ob, v ? CBOR_TRUE : CBOR_FALSE);
+  }
+}
+
+void
+rec_str(emrec_t *r, const char *key, const char *s)
+{
+  rec_key(r, key);
+  if (REC_JSONL == r->format) {
+    json_str(r->ob, s);
+  } else {
+    cbor_str(r->ob, s);
+  }
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
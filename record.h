@@ -0,0 +1,76 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef ELFMOD_RECORD_H
+#define ELFMOD_RECORD_H
+
+#include <stdint.h>
+
+#include "outbuf.h"
+
+/*
+ * Structured output (-o), one record per file displayed, for programs
+ * rather than people to read. A record is a map of keys to numbers,
+ * strings, booleans, and arrays and maps of those, written as it is built
+ * so that nothing is held beyond what is in the output buffer. The same
+ * calls produce either format:
+ *
+ *   REC_JSONL  One JSON object per line. Bytes that are not part of valid
+ *              UTF-8 are escaped as \u00XX, so the output always is.
+ *   REC_CBOR   A CBOR sequence (RFC 8742) of maps, using indefinite length
+ *              maps and arrays. Strings that are not valid UTF-8 are
+ *              written as byte strings rather than text.
+ *
+ * Every value inside a map is given a key; values inside an array and the
+ * record itself are given a key of 0.
+ */
+#define REC_TEXT                0
+#define REC_JSONL               1
+#define REC_CBOR                2
+
+#define REC_MAXDEPTH            8
+
+typedef struct {
+  emobuf_t *ob;
+  int format;                   /* REC_xxx */
+  int depth;
+  int count[REC_MAXDEPTH];      /* Values so far at each level, for commas */
+  char close[REC_MAXDEPTH];     /* What ends each level */
+} emrec_t;
+
+extern void rec_init(emrec_t *r, emobuf_t *ob, int format);
+extern void rec_map(emrec_t *r, const char *key);
+extern void rec_array(emrec_t *r, const char *key);
+extern void rec_end(emrec_t *r);
+extern void rec_uint(emrec_t *r, const char *key, uint64_t v);
+extern void rec_bool(emrec_t *r, const char *key, int v);
+extern void rec_str(emrec_t *r, const char *key, const char *s);
+
+#endif /* ELFMOD_RECORD_H */
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
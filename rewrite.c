@@ -0,0 +1,288 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * O_TMPFILE, copy_file_range() and friends are only declared with
+ * _GNU_SOURCE, which we keep out of the rest of the program for the reasons
+ * given in cache.c.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "elfmod.h"
+
+/*
+ * An edit that does not fit within the file as it stands is written to a
+ * new copy of the file, which then replaces the original. Almost all of a
+ * typical file (its text, data and debug information) is the same in both,
+ * so we never copy it through user space if we can avoid it. Where the
+ * filesystem supports it the copy shares the original's extents (FICLONE)
+ * and costs nothing but metadata. Failing that copy_file_range() keeps the
+ * copy inside the kernel, which may still be able to share or offload it.
+ * Only when neither is available do we fall back to read() and write().
+ * The caller then writes the few regions that actually move.
+ *
+ * The copy is made as an unnamed O_TMPFILE in the same directory, so that
+ * nothing (including a concurrent -T walk) can see it half written. It is
+ * only given a name immediately before being renamed over the original.
+ */
+
+/*
+ * Copy flen bytes from ifd to ofd, the hard way.
+ */
+static int
+copy_slow(int ifd, int ofd, off_t pos, size_t flen)
+{
+  char buf[65536];
+  ssize_t n;
+
+  while ((size_t)pos < flen) {
+    n = emsys(pread(ifd, buf, sizeof(buf), pos));
+    if (n <= 0) {
+      if (0 == n) {
+        errno = EIO;
+      }
+      return -1;
+    }
+    if (emsys(pwrite(ofd, buf, n, pos)) != n) {
+      return -1;
+    }
+    pos += n;
+  }
+
+  return 0;
+}
+
+/*
+ * Make ofd a copy of the first flen bytes of ifd. Returns 1 if the copy
+ * shares the original's extents, 0 if the data was copied, or -1 on error.
+ */
+static int
+copy_file(int ifd, int ofd, size_t flen)
+{
+  loff_t ipos = 0, opos = 0;
+  ssize_t n;
+
+  if (0 == emsys(ioctl(ofd, FICLONE, ifd))) {
+    return 1;
+  }
+
+  while ((size_t)ipos < flen) {
+    n = emsys(copy_file_range(ifd, &ipos, ofd, &opos, flen - ipos, 0));
+    if (n <= 0) {
+      if ((n < 0) && ((EXDEV == errno) || (EINVAL == errno) || (ENOSYS == errno) || (EOPNOTSUPP == errno))) {
+        return copy_slow(ifd, ofd, ipos, flen);
+      }
+      if (0 == n) {
+        errno = EIO;
+      }
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int
+rewrite_begin(emctx_t *ctx, size_t flen, emrewrite_t *rw)
+{
+  char *slash;
+  int cloned;
+
+  memset(rw, 0, sizeof(*rw));
+  rw->fd = -1;
+
+  /*
+   * If we were given a symbolic link it is the file it points to that has
+   * to be replaced, not the link.
+   */
+  rw->path = realpath(ctx->curfile, 0);
+  if (0 == rw->path) {
+    fprintf(ctx->err, "%s error: could not resolve `%s': %s\n", progname, ctx->curfile, strerror(errno));
+    return 1;
+  }
+
+  slash = strrchr(rw->path, '/');
+  *slash = 0;
+  rw->fd = emsys(open(slash == rw->path ? "/" : rw->path, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600));
+  *slash = '/';
+
+  /*
+   * Not every filesystem supports O_TMPFILE. Those that do not get a named
+   * temporary file, which is as good apart from being visible.
+   */
+  if ((rw->fd < 0) && ((EOPNOTSUPP == errno) || (EISDIR == errno) || (EINVAL == errno))) {
+    rw->tmpname = (char *)malloc(strlen(rw->path) + 8);
+    sprintf(rw->tmpname, "%s.XXXXXX", rw->path);
+    rw->fd = emsys(mkostemp(rw->tmpname, O_CLOEXEC));
+    if (rw->fd < 0) {
+      free(rw->tmpname);
+      rw->tmpname = 0;
+    }
+  }
+
+  if (rw->fd < 0) {
+    fprintf(ctx->err, "%s error: could not create a new copy of `%s': %s\n", progname, ctx->curfile, strerror(errno));
+    rewrite_abort(rw);
+    return 1;
+  }
+
+  cloned = copy_file(ctx->fd, rw->fd, flen);
+  if (cloned < 0) {
+    fprintf(ctx->err, "%s error: could not copy `%s': %s\n", progname, ctx->curfile, strerror(errno));
+    rewrite_abort(rw);
+    return 1;
+  }
+  rw->cloned = cloned;
+
+  return 0;
+}
+
+/*
+ * Give an O_TMPFILE a name next to the file it is replacing, so that it can
+ * be renamed over it.
+ */
+static int
+link_tmpfile(emrewrite_t *rw)
+{
+  static unsigned int serial;
+  char procname[64];
+  size_t len = strlen(rw->path) + 32;
+  int tries;
+
+  snprintf(procname, sizeof(procname), "/proc/self/fd/%d", rw->fd);
+  rw->tmpname = (char *)malloc(len);
+
+  for (tries = 0; tries < 100; tries++) {
+    snprintf(rw->tmpname, len, "%s.%ld.%u", rw->path, (long)getpid(), __atomic_add_fetch(&serial, 1, __ATOMIC_RELAXED));
+
+    if ((0 == emsys(linkat(AT_FDCWD, procname, AT_FDCWD, rw->tmpname, AT_SYMLINK_FOLLOW))) ||
+        ((ENOENT == errno) && (0 == emsys(linkat(rw->fd, "", AT_FDCWD, rw->tmpname, AT_EMPTY_PATH))))) {
+      return 0;
+    }
+
+    if (EEXIST != errno) {
+      break;
+    }
+  }
+
+  free(rw->tmpname);
+  rw->tmpname = 0;
+  return -1;
+}
+
+int
+rewrite_finish(emctx_t *ctx, emrewrite_t *rw)
+{
+  struct stat st;
+  mode_t mode;
+
+  if (emsys(fstat(ctx->fd, &st))) {
+    fprintf(ctx->err, "%s error: could not stat `%s': %s\n", progname, ctx->curfile, strerror(errno));
+    rewrite_abort(rw);
+    return 1;
+  }
+
+  /*
+   * The new file should look like the old one. If we can not give it the
+   * same owner we can still give it the same permissions, less any set-id
+   * bits, which would otherwise now apply to us rather than the owner.
+   */
+  mode = st.st_mode & 07777;
+  if (emsys(fchown(rw->fd, st.st_uid, st.st_gid))) {
+    mode &= ~(S_ISUID | S_ISGID);
+  }
+
+  if (emsys(fchmod(rw->fd, mode))) {
+    fprintf(ctx->err, "%s error: could not set the mode of the new `%s': %s\n", progname, ctx->curfile, strerror(errno));
+    rewrite_abort(rw);
+    return 1;
+  }
+
+  if ((0 == rw->tmpname) && link_tmpfile(rw)) {
+    fprintf(ctx->err, "%s error: could not link the new `%s': %s\n", progname, ctx->curfile, strerror(errno));
+    rewrite_abort(rw);
+    return 1;
+  }
+
+  if (emsys(rename(rw->tmpname, rw->path))) {
+    fprintf(ctx->err, "%s error: could not replace `%s': %s\n", progname, ctx->curfile, strerror(errno));
+    rewrite_abort(rw);
+    return 1;
+  }
+
+  /*
+   * From here on the caller's descriptor refers to the new file.
+   */
+  if (emsys(dup2(rw->fd, ctx->fd)) < 0) {
+    fprintf(ctx->err, "%s error: could not reopen `%s': %s\n", progname, ctx->curfile, strerror(errno));
+    free(rw->tmpname);
+    rw->tmpname = 0;
+    rewrite_abort(rw);
+    return 1;
+  }
+  emsys(close(rw->fd));
+  free(rw->tmpname);
+  free(rw->path);
+
+  emstat_add(rewritten, 1);
+  if (rw->cloned) {
+    emstat_add(cloned, 1);
+  }
+
+  return 0;
+}
+
+void
+rewrite_abort(emrewrite_t *rw)
+{
+  if (rw->tmpname) {
+    emsys(unlink(rw->tmpname));
+    free(rw->tmpname);
+  }
+  if (rw->fd >= 0) {
+    emsys(close(rw->fd));
+  }
+  free(rw->path);
+  memset(rw, 0, sizeof(*rw));
+  rw->fd = -1;
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
@@ -0,0 +1,471 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fnmatch.h>
+
+#include "elfmod.h"
+
+/*
+ * A -W predicate picks the files a run works on by what is in their dynamic
+ * section, for example
+ *
+ *   needed ~ "libfoo*" && !runpath
+ *
+ * A test is a field on its own, which is true if the file has any such
+ * entry, or a field compared with a value: == for an exact match, ~ for an
+ * fnmatch() pattern, and != and !~ for the opposite of those. The fields are
+ * interp, soname, needed, rpath, runpath and flags. needed and flags can
+ * have several values, and a comparison is true if any of them matches.
+ * The values of flags are the names -F shows (ORIGIN, SYMBOLIC, TEXTREL,
+ * BIND_NOW and STATIC_TLS). Tests are combined with !, && and || and
+ * grouped with parentheses. Values can be given in double quotes, with \"
+ * and \\ for a quote and a backslash, or as a bare word if they contain no
+ * spaces or operator characters.
+ *
+ * The predicate is parsed once, before any file is looked at, into a short
+ * program for a machine with a single truth register: each test sets it,
+ * SEL_NOT inverts it, and && and || become conditional jumps past the rest
+ * of their operands, so that evaluation stops as soon as the answer is
+ * known. Patterns are compiled into globsets and flag names into bit masks
+ * up front, so running the program for a file is a handful of string
+ * comparisons against its emxinfo_t.
+ */
+#define SEL_HAS                 1       /* Field has any value */
+#define SEL_EQ                  2       /* Any value is str */
+#define SEL_GLOB                3       /* Any value matches glob */
+#define SEL_FLAGS               4       /* Any of the flags in arg are set */
+#define SEL_NOT                 5       /* Invert the result so far */
+#define SEL_JF                  6       /* Jump to arg if false */
+#define SEL_JT                  7       /* Jump to arg if true */
+
+#define SEL_F_INTERP            0
+#define SEL_F_SONAME            1
+#define SEL_F_NEEDED            2
+#define SEL_F_RPATH             3
+#define SEL_F_RUNPATH           4
+#define SEL_F_FLAGS             5
+
+typedef struct {
+  uint32_t op;                  /* SEL_xxx */
+  uint32_t field;               /* SEL_F_xxx the test is on */
+  uint32_t arg;                 /* Flag bits, or where to jump to */
+  const char *str;              /* Value to compare with */
+  globset_t *glob;              /* Or pattern to match */
+} emselop_t;
+
+struct emsel {
+  emselop_t *code;
+  uint32_t ncode;
+  uint32_t codesz;
+  strlist_t **pats;             /* What each glob was built from */
+  uint32_t npats;
+};
+
+static const char *const field_names[] = {
+  "interp", "soname", "needed", "rpath", "runpath", "flags", 0
+};
+
+static const struct {
+  const char *name;
+  uint32_t flag;
+} flag_names[] = {
+  { "ORIGIN", DF_ORIGIN },
+  { "SYMBOLIC", DF_SYMBOLIC },
+  { "TEXTREL", DF_TEXTREL },
+  { "BIND_NOW", DF_BIND_NOW },
+  { "STATIC_TLS", DF_STATIC_TLS },
+  { 0, 0 }
+};
+
+typedef struct {
+  emsel_t *sel;
+  const char *expr;             /* The whole predicate, for errors */
+  const char *p;                /* Where we are in it */
+  char *tok;                    /* The last word or string read */
+  int error;
+} emselparse_t;
+
+static void
+parse_error(emselparse_t *ps, const char *what)
+{
+  if (0 == ps->error) {
+    fprintf(stderr, "%s: bad -W predicate `%s': %s at `%s'. See %s -H for usage.\n",
+        progname, ps->expr, what, *ps->p ? ps->p : "end", progname);
+    ps->error = 1;
+  }
+}
+
+static uint32_t
+emit(emselparse_t *ps, uint32_t op, uint32_t field, uint32_t arg)
+{
+  emsel_t *sel = ps->sel;
+  emselop_t *o;
+
+  if (sel->ncode == sel->codesz) {
+    sel->codesz = sel->codesz ? sel->codesz * 2 : 16;
+    sel->code = (emselop_t *)realloc(sel->code, sel->codesz * sizeof(emselop_t));
+  }
+
+  o = &sel->code[sel->ncode];
+  memset(o, 0, sizeof(*o));
+  o->op = op;
+  o->field = field;
+  o->arg = arg;
+
+  return sel->ncode++;
+}
+
+static void
+skip_space(emselparse_t *ps)
+{
+  while ((' ' == *ps->p) || ('\t' == *ps->p) || ('\n' == *ps->p)) {
+    ps->p++;
+  }
+}
+
+/*
+ * If the predicate continues with op, step over it.
+ */
+static int
+accept(emselparse_t *ps, const char *op)
+{
+  size_t ol = strlen(op);
+
+  skip_space(ps);
+  if (0 == strncmp(ps->p, op, ol)) {
+    ps->p += ol;
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Read a quoted string or a bare word into ps->tok.
+ */
+static int
+read_word(emselparse_t *ps)
+{
+  const char *s;
+  char *d;
+
+  skip_space(ps);
+  free(ps->tok);
+  ps->tok = d = (char *)malloc(strlen(ps->p) + 1);
+
+  if ('"' == *ps->p) {
+    for (s = ps->p + 1; *s && ('"' != *s); s++) {
+      if (('\\' == *s) && s[1]) {
+        s++;
+      }
+      *d++ = *s;
+    }
+    if (0 == *s) {
+      parse_error(ps, "unterminated string");
+      return 1;
+    }
+    *d = 0;
+    ps->p = s + 1;
+    return 0;
+  }
+
+  for (s = ps->p; *s && (0 == strchr(" \t\n()!&|=~\"", *s)); s++) {
+    *d++ = *s;
+  }
+  *d = 0;
+  if (s == ps->p) {
+    parse_error(ps, "expected a word");
+    return 1;
+  }
+  ps->p = s;
+
+  return 0;
+}
+
+static void parse_or(emselparse_t *ps);
+
+/*
+ * A field, optionally compared with a value.
+ */
+static void
+parse_test(emselparse_t *ps)
+{
+  emsel_t *sel = ps->sel;
+  const char *start;
+  uint32_t field, mask = 0, i;
+  int op = SEL_HAS, neg = 0;
+
+  skip_space(ps);
+  start = ps->p;
+  if (read_word(ps)) {
+    return;
+  }
+
+  for (field = 0; field_names[field]; field++) {
+    if (0 == strcmp(field_names[field], ps->tok)) {
+      break;
+    }
+  }
+  if (0 == field_names[field]) {
+    ps->p = start;
+    parse_error(ps, "unknown field");
+    return;
+  }
+
+  if (accept(ps, "==")) {
+    op = SEL_EQ;
+  } else if (accept(ps, "!=")) {
+    op = SEL_EQ;
+    neg = 1;
+  } else if (accept(ps, "~")) {
+    op = SEL_GLOB;
+  } else if (accept(ps, "!~")) {
+    op = SEL_GLOB;
+    neg = 1;
+  }
+
+  skip_space(ps);
+  start = ps->p;
+  if ((SEL_HAS != op) && read_word(ps)) {
+    return;
+  }
+
+  /*
+   * Flags are known by name, so any test of them is a question of whether
+   * any of a set of bits is set.
+   */
+  if (SEL_F_FLAGS == field) {
+    for (i = 0; flag_names[i].name; i++) {
+      if ((SEL_HAS == op) ||
+          ((SEL_EQ == op) && (0 == strcmp(flag_names[i].name, ps->tok))) ||
+          ((SEL_GLOB == op) && (0 == fnmatch(ps->tok, flag_names[i].name, 0)))) {
+        mask |= flag_names[i].flag;
+      }
+    }
+    if ((SEL_EQ == op) && (0 == mask)) {
+      ps->p = start;
+      parse_error(ps, "unknown flag");
+      return;
+    }
+    emit(ps, SEL_FLAGS, field, (SEL_HAS == op) ? 0xffffffffU : mask);
+  } else {
+    i = emit(ps, op, field, 0);
+    if (SEL_EQ == op) {
+      sel->code[i].str = ps->tok;
+      ps->tok = 0;
+    } else if (SEL_GLOB == op) {
+      sel->pats = (strlist_t **)realloc(sel->pats, (sel->npats + 1) * sizeof(strlist_t *));
+      sel->pats[sel->npats] = sl_new(1);
+      sl_stradd(sel->pats[sel->npats], ps->tok);
+      sel->code[i].glob = globset_new(sel->pats[sel->npats], 0);
+      sel->npats++;
+    }
+  }
+
+  if (neg) {
+    emit(ps, SEL_NOT, 0, 0);
+  }
+}
+
+static void
+parse_unary(emselparse_t *ps)
+{
+  if (accept(ps, "!")) {
+    parse_unary(ps);
+    emit(ps, SEL_NOT, 0, 0);
+  } else if (accept(ps, "(")) {
+    parse_or(ps);
+    if (!ps->error && !accept(ps, ")")) {
+      parse_error(ps, "expected `)'");
+    }
+  } else {
+    parse_test(ps);
+  }
+}
+
+/*
+ * A run of operands joined by && (or ||, with op SEL_JT). Every jump past
+ * the rest of them lands at the end of the run.
+ */
+static void
+parse_chain(emselparse_t *ps, const char *opstr, uint32_t op, void (*operand)(emselparse_t *))
+{
+  uint32_t *jumps = 0, njumps = 0, i;
+
+  operand(ps);
+  while (!ps->error && accept(ps, opstr)) {
+    jumps = (uint32_t *)realloc(jumps, (njumps + 1) * sizeof(uint32_t));
+    jumps[njumps++] = emit(ps, op, 0, 0);
+    operand(ps);
+  }
+
+  for (i = 0; i < njumps; i++) {
+    ps->sel->code[jumps[i]].arg = ps->sel->ncode;
+  }
+  free(jumps);
+}
+
+static void
+parse_and(emselparse_t *ps)
+{
+  parse_chain(ps, "&&", SEL_JF, parse_unary);
+}
+
+static void
+parse_or(emselparse_t *ps)
+{
+  parse_chain(ps, "||", SEL_JT, parse_and);
+}
+
+/*
+ * Compile a -W predicate, or complain and return 0 if it cannot be.
+ */
+emsel_t *
+select_compile(const char *expr)
+{
+  emselparse_t ps;
+
+  memset(&ps, 0, sizeof(ps));
+  ps.sel = (emsel_t *)calloc(1, sizeof(emsel_t));
+  ps.expr = expr;
+  ps.p = expr;
+
+  parse_or(&ps);
+  skip_space(&ps);
+  if (!ps.error && *ps.p) {
+    parse_error(&ps, "unexpected text");
+  }
+  free(ps.tok);
+
+  if (ps.error) {
+    select_free(ps.sel);
+    return 0;
+  }
+
+  return ps.sel;
+}
+
+void
+select_free(emsel_t *sel)
+{
+  uint32_t i;
+
+  if (0 == sel) {
+    return;
+  }
+
+  for (i = 0; i < sel->ncode; i++) {
+    free((char *)sel->code[i].str);
+    globset_free(sel->code[i].glob);
+  }
+  for (i = 0; i < sel->npats; i++) {
+    sl_free(sel->pats[i]);
+  }
+  free(sel->pats);
+  free(sel->code);
+  free(sel);
+}
+
+static inline int
+test_value(const emselop_t *o, const char *val)
+{
+  switch (o->op) {
+    case SEL_HAS:
+      return 1;
+    case SEL_EQ:
+      return 0 == strcmp(o->str, val);
+    default:
+      return globset_match(o->glob, val);
+  }
+}
+
+/*
+ * Run the predicate against what the processor found in a file.
+ */
+int
+select_match(const emsel_t *sel, const emxinfo_t *xi)
+{
+  const emselop_t *o;
+  const char *val;
+  uint32_t pc, i;
+  int acc = 0;
+
+  for (pc = 0; pc < sel->ncode; pc++) {
+    o = &sel->code[pc];
+
+    switch (o->op) {
+      case SEL_NOT:
+        acc = !acc;
+        continue;
+      case SEL_JF:
+        if (!acc) {
+          pc = o->arg - 1;
+        }
+        continue;
+      case SEL_JT:
+        if (acc) {
+          pc = o->arg - 1;
+        }
+        continue;
+      case SEL_FLAGS:
+        acc = (xi->flags & o->arg) ? 1 : 0;
+        continue;
+    }
+
+    if (SEL_F_NEEDED == o->field) {
+      for (acc = 0, i = 0; !acc && (i < xi->nneeded); i++) {
+        acc = test_value(o, xi->needed[i]);
+      }
+      continue;
+    }
+
+    switch (o->field) {
+      case SEL_F_INTERP:
+        val = xi->interp;
+        break;
+      case SEL_F_SONAME:
+        val = xi->soname;
+        break;
+      case SEL_F_RPATH:
+        val = xi->rpath;
+        break;
+      default:
+        val = xi->runpath;
+        break;
+    }
+    acc = val ? test_value(o, val) : 0;
+  }
+
+  return acc;
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
@@ -0,0 +1,114 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Times the string list operations at a range of sizes, to show that they
+ * cost the same per string however long the list gets. Run it with
+ * "make bench". Each size is timed adding n different strings, deleting
+ * them all again by value, and then with the list full, deleting and adding
+ * back one string at a time, which is what editing a search path does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "strlist.h"
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+  static const int sizes[] = { 1000, 2000, 5000, 10000, 20000, 50000, 100000 };
+  char **names;
+  strlist_t *sl;
+  double t0, t1, t2, t3;
+  int i, si, n, max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+
+  (void)argc;
+  (void)argv;
+
+  names = (char **)malloc(max * sizeof(char *));
+  for (i = 0; i < max; i++) {
+    names[i] = (char *)malloc(32);
+    snprintf(names[i], 32, "/usr/lib/lib%08x.so", (unsigned)i * 2654435761U);
+  }
+
+  printf("%8s  %12s  %12s  %12s\n", "strings", "add ns/op", "del ns/op", "churn ns/op");
+  for (si = 0; si < (int)(sizeof(sizes) / sizeof(sizes[0])); si++) {
+    n = sizes[si];
+    sl = sl_new(5);
+
+    t0 = now();
+    for (i = 0; i < n; i++) {
+      sl_stradd(sl, names[i]);
+    }
+    t1 = now();
+    for (i = 0; i < n; i++) {
+      sl_cmpdel(sl, names[i]);
+    }
+    t2 = now();
+    for (i = 0; i < n; i++) {
+      sl_stradd(sl, names[i]);
+    }
+    for (i = 0; i < n; i++) {
+      int victim = (int)(((unsigned)i * 40503U) % (unsigned)n);
+
+      sl_cmpdel(sl, names[victim]);
+      sl_stradd(sl, names[victim]);
+    }
+    t3 = now();
+
+    if (sl->nstrs != n) {
+      fprintf(stderr, "slbench: %d strings in the list, expected %d\n", sl->nstrs, n);
+      return 1;
+    }
+
+    printf("%8d  %12.1f  %12.1f  %12.1f\n", n, (t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / n, (t3 - t2) * 1e9 / (3 * n));
+    sl_free(sl);
+  }
+
+  for (i = 0; i < max; i++) {
+    free(names[i]);
+  }
+  free(names);
+
+  return 0;
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */
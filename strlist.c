@@ -29,6 +29,212 @@
 
 #include "strlist.h"
 
+#define SL_HASHSEED             2166136261U
+
+static unsigned int
+sl_hash(const char *str, size_t len)
+{
+  unsigned int h = SL_HASHSEED;
+
+  while (len--) {
+    h ^= (unsigned char)*str++;
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+/*
+ * Memory for the list comes from its arena if it has one, or the heap.
+ */
+static void *
+sl_calloc(const strlist_t *lst, size_t len)
+{
+  return lst->arena ? arena_calloc(lst->arena, len) : calloc(1, len);
+}
+
+static void
+sl_release(const strlist_t *lst, void *p)
+{
+  if (0 == lst->arena) {
+    free(p);
+  }
+}
+
+/*
+ * Resize one of the per-slot arrays from osz to nsz entries of esz bytes,
+ * clearing the new ones.
+ */
+static void *
+sl_resize(const strlist_t *lst, void *p, size_t esz, int osz, int nsz)
+{
+  if (lst->arena) {
+    p = arena_grow(lst->arena, p, osz * esz, nsz * esz);
+  } else {
+    p = realloc(p, nsz * esz);
+  }
+  memset((char *)p + osz * esz, 0, (nsz - osz) * esz);
+
+  return p;
+}
+
+/*
+ * Rebuild the index from scratch, at least twice as big as the number of
+ * strings in the list. This also clears out deleted entries.
+ */
+static void
+sl_reindex(strlist_t *lst)
+{
+  int i, sz = 16;
+  unsigned int h;
+
+  while (sz < 4 * (lst->nstrs + 1)) {
+    sz <<= 1;
+  }
+
+  sl_release(lst, lst->index);
+  lst->index = (int *)sl_calloc(lst, sz * sizeof(int));
+  lst->indexsz = sz;
+  lst->nindex = 0;
+
+  for (i = 0; i < lst->nused; i++) {
+    if (lst->strs[i]) {
+      for (h = sl_hash(lst->strs[i], lst->lens[i]) & (sz - 1); lst->index[h]; h = (h + 1) & (sz - 1))
+        ; /* Do nothing */
+      lst->index[h] = i + 1;
+      lst->nindex++;
+    }
+  }
+}
+
+/*
+ * Add slot to the index, rebuilding it if it is getting full.
+ */
+static void
+sl_index(strlist_t *lst, int slot)
+{
+  unsigned int h;
+
+  if (2 * (lst->nindex + 1) > lst->indexsz) {
+    sl_reindex(lst);
+    return;
+  }
+
+  for (h = sl_hash(lst->strs[slot], lst->lens[slot]) & (lst->indexsz - 1); lst->index[h] > 0; h = (h + 1) & (lst->indexsz - 1))
+    ; /* Do nothing */
+  if (0 == lst->index[h]) {
+    lst->nindex++;
+  }
+  lst->index[h] = slot + 1;
+}
+
+/*
+ * Find the index entry for a string. If byvalue is non-zero any string with
+ * the same value will do, otherwise it must be that very pointer. Returns
+ * the position in the index or -1.
+ */
+static int
+sl_find(const strlist_t *lst, strview_t sv, int byvalue)
+{
+  unsigned int h;
+  int slot;
+
+  if (0 == lst->indexsz) {
+    return -1;
+  }
+
+  for (h = sl_hash(sv.str, sv.len) & (lst->indexsz - 1); lst->index[h]; h = (h + 1) & (lst->indexsz - 1)) {
+    slot = lst->index[h] - 1;
+    if ((slot < 0) || (0 == lst->strs[slot])) {
+      continue;
+    }
+    if (byvalue ? ((lst->lens[slot] == sv.len) && (0 == memcmp(lst->strs[slot], sv.str, sv.len))) : (lst->strs[slot] == sv.str)) {
+      return h;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * Remember that slot is empty, and take back the lowest empty slot.
+ */
+static void
+sl_addhole(strlist_t *lst, int slot)
+{
+  int i, p;
+
+  if (lst->nholes == lst->holesz) {
+    int nsz = lst->holesz ? 2 * lst->holesz : 16;
+
+    lst->holes = (int *)sl_resize(lst, lst->holes, sizeof(int), lst->holesz, nsz);
+    lst->holesz = nsz;
+  }
+
+  for (i = lst->nholes++; (i > 0) && (lst->holes[p = (i - 1) / 2] > slot); i = p) {
+    lst->holes[i] = lst->holes[p];
+  }
+  lst->holes[i] = slot;
+}
+
+static int
+sl_takehole(strlist_t *lst)
+{
+  int slot = lst->holes[0], last = lst->holes[--lst->nholes], i = 0, c;
+
+  while ((c = 2 * i + 1) < lst->nholes) {
+    if ((c + 1 < lst->nholes) && (lst->holes[c + 1] < lst->holes[c])) {
+      c++;
+    }
+    if (lst->holes[c] >= last) {
+      break;
+    }
+    lst->holes[i] = lst->holes[c];
+    i = c;
+  }
+  lst->holes[i] = last;
+
+  return slot;
+}
+
+/*
+ * Put a string in a slot, either pointing at it or copying it.
+ */
+static void
+sl_fill(strlist_t *lst, int slot, strview_t sv, int borrow)
+{
+  char *s;
+
+  if (borrow && (0 == sv.str[sv.len])) {
+    lst->strs[slot] = (char *)sv.str;
+    lst->owned[slot] = 0;
+  } else {
+    s = lst->arena ? (char *)arena_alloc(lst->arena, sv.len + 1) : (char *)malloc(sv.len + 1);
+    memcpy(s, sv.str, sv.len);
+    s[sv.len] = 0;
+    lst->strs[slot] = s;
+    lst->owned[slot] = 1;
+  }
+  lst->lens[slot] = sv.len;
+}
+
+/*
+ * Empty a slot, and its index entry h if it has one.
+ */
+static void
+sl_empty(strlist_t *lst, int slot, int h)
+{
+  if (lst->owned[slot]) {
+    sl_release(lst, lst->strs[slot]);
+  }
+  lst->strs[slot] = 0;
+  lst->nstrs--;
+  sl_addhole(lst, slot);
+  if (h >= 0) {
+    lst->index[h] = -1;
+  }
+}
+
 strlist_t *
 sl_new(int numstrs)
 {
@@ -36,6 +242,22 @@ sl_new(int numstrs)
 
   lst->strsz = numstrs;
   lst->strs = (char **)calloc(numstrs, sizeof(char *));
+  lst->lens = (size_t *)calloc(numstrs, sizeof(size_t));
+  lst->owned = (unsigned char *)calloc(numstrs, 1);
+
+  return lst;
+}
+
+strlist_t *
+sl_new_arena(emarena_t *arena, int numstrs)
+{
+  strlist_t *lst = (strlist_t *)arena_calloc(arena, sizeof(strlist_t));
+
+  lst->arena = arena;
+  lst->strsz = numstrs;
+  lst->strs = (char **)arena_calloc(arena, numstrs * sizeof(char *));
+  lst->lens = (size_t *)arena_calloc(arena, numstrs * sizeof(size_t));
+  lst->owned = (unsigned char *)arena_calloc(arena, numstrs);
 
   return lst;
 }
@@ -45,48 +267,89 @@ sl_free(strlist_t *sl)
 {
   int i;
 
-  if (0 == sl) {
+  if ((0 == sl) || sl->arena) {
     return;
   }
 
   for (i = 0; i < sl->strsz; i++) {
-    free(sl->strs[i]);
+    if (sl->owned[i]) {
+      free(sl->strs[i]);
+    }
     sl->strs[i] = 0;
   }
   free(sl->strs);
   sl->strs = 0;
+  free(sl->lens);
+  free(sl->owned);
+  free(sl->index);
+  free(sl->holes);
   free(sl);
 }
 
 void
 sl_stradd(strlist_t *lst, const char *newstr)
 {
-  int i, avail = -1;
+  sl_viewadd(lst, sv_cstr(newstr), 0);
+}
 
-  for (i = 0; i < lst->strsz; i++) {
-    if (0 == lst->strs[i]) {
-      if (-1 == avail) {
-        avail = i;
-      }
-      continue;
-    }
+void
+sl_viewadd(strlist_t *lst, strview_t sv, int borrow)
+{
+  int avail;
 
-    if (0 == strcmp(lst->strs[i], newstr)) {
-      return;
-    }
+  if (sl_find(lst, sv, 1) >= 0) {
+    return;
   }
 
-  if (-1 == avail) {
-    lst->strs = (char **)realloc(lst->strs, (lst->strsz + 5) * sizeof(char *));
-    for (i = 0; i < 5; i++) {
-      lst->strs[lst->strsz + i] = 0;
+  /*
+   * Fill the first hole left by a deletion if there is one, otherwise use
+   * the next slot never used, doubling the list if there isn't one.
+   */
+  if (lst->nholes) {
+    avail = sl_takehole(lst);
+  } else {
+    if (lst->nused == lst->strsz) {
+      int nsz = lst->strsz ? 2 * lst->strsz : 5;
+
+      lst->strs = (char **)sl_resize(lst, lst->strs, sizeof(char *), lst->strsz, nsz);
+      lst->lens = (size_t *)sl_resize(lst, lst->lens, sizeof(size_t), lst->strsz, nsz);
+      lst->owned = (unsigned char *)sl_resize(lst, lst->owned, 1, lst->strsz, nsz);
+      lst->strsz = nsz;
     }
-    avail = lst->strsz;
-    lst->strsz += 5;
+    avail = lst->nused++;
   }
 
-  lst->strs[avail] = strdup(newstr);
+  sl_fill(lst, avail, sv, borrow);
   lst->nstrs++;
+  sl_index(lst, avail);
+}
+
+/*
+ * Replace the string in slot idx, keeping its place in the list. Unlike
+ * adding, this does not check whether the new value is already there.
+ */
+void
+sl_replace(strlist_t *lst, int idx, strview_t sv, int borrow)
+{
+  strview_t old;
+  int h;
+
+  if ((idx >= lst->strsz) || (0 == lst->strs[idx]) || (lst->strs[idx] == sv.str)) {
+    return;
+  }
+
+  old.str = lst->strs[idx];
+  old.len = lst->lens[idx];
+  h = sl_find(lst, old, 0);
+  if (h >= 0) {
+    lst->index[h] = -1;
+  }
+  if (lst->owned[idx]) {
+    sl_release(lst, lst->strs[idx]);
+  }
+
+  sl_fill(lst, idx, sv, borrow);
+  sl_index(lst, idx);
 }
 
 void
@@ -100,49 +363,63 @@ sl_lstadd(strlist_t *sl, const strlist_t *ol)
 
   for (i = 0; i < ol->strsz; i++) {
     if (ol->strs[i]) {
-      sl_stradd(sl, ol->strs[i]);
+      strview_t sv;
+
+      sv.str = ol->strs[i];
+      sv.len = ol->lens[i];
+      sl_viewadd(sl, sv, 0);
     }
   }
 }
 
+/*
+ * Add each non-empty piece of sv between any of the characters in splitcs.
+ * If borrow is non-zero, pieces that are NUL terminated where they end (only
+ * ever the last) are borrowed rather than copied.
+ */
 void
-sl_splitadd(strlist_t *lst, const char *str, const char *splitcs)
+sl_splitadd(strlist_t *lst, strview_t sv, const char *splitcs, int borrow)
 {
-  char tstr[2048];
+  strview_t piece;
   size_t x;
 
-  if (0 == str[0]) {
-    return;
-  }
-
-  for (;;) {
-    x = strcspn(str, splitcs);
+  while (sv.len) {
+    for (x = 0; (x < sv.len) && (0 == strchr(splitcs, sv.str[x])); x++)
+      ; /* Do nothing */
     if (x) {
-      memcpy(tstr, str, x);
-      tstr[x] = 0;
-      sl_stradd(lst, tstr);
+      piece.str = sv.str;
+      piece.len = x;
+      sl_viewadd(lst, piece, borrow);
     }
-    if (0 == str[x]) {
+    if (x == sv.len) {
       return;
     }
-    str += x + 1;
+    sv.str += x + 1;
+    sv.len -= x + 1;
   }
 }
 
 void
 sl_strdel(strlist_t *lst, char *str)
 {
-  int i;
+  int h, i;
 
   if (0 == str) {
     return;
   }
 
+  h = sl_find(lst, sv_cstr(str), 0);
+  if (h >= 0) {
+    sl_empty(lst, lst->index[h] - 1, h);
+    return;
+  }
+
+  /*
+   * Not in the index, so it must have been put in the list by hand.
+   */
   for (i = 0; i < lst->strsz; i++) {
     if (lst->strs[i] == str) {
-      free(str);
-      lst->strs[i] = 0;
-      lst->nstrs--;
+      sl_empty(lst, i, -1);
       return;
     }
   }
@@ -155,27 +432,21 @@ sl_idxdel(strlist_t *lst, int idx)
     return;
   }
 
-  free(lst->strs[idx]);
-  lst->strs[idx] = 0;
-  lst->nstrs--;
+  sl_strdel(lst, lst->strs[idx]);
 }
 
 void
 sl_cmpdel(strlist_t *lst, const char *str)
 {
-  int i;
+  int h;
 
   if (0 == str) {
     return;
   }
 
-  for (i = 0; i < lst->strsz; i++) {
-    if (lst->strs[i] && (0 == strcmp(lst->strs[i], str))) {
-      free(lst->strs[i]);
-      lst->strs[i] = 0;
-      lst->nstrs--;
-      return;
-    }
+  h = sl_find(lst, sv_cstr(str), 1);
+  if (h >= 0) {
+    sl_empty(lst, lst->index[h] - 1, h);
   }
 }
 
@@ -191,10 +462,14 @@ sl_lstdel(strlist_t *lst, const strlist_t *olst)
   }
 }
 
+/*
+ * Join the non-empty strings in the list with joinc between them. The
+ * result comes from the list's arena if it has one.
+ */
 char *
 sl_join(const strlist_t *sl, int joinc)
 {
-  char *rs, js[2];
+  char *rs, *cp;
   int i;
   size_t tl = 0;
 
@@ -202,26 +477,22 @@ sl_join(const strlist_t *sl, int joinc)
     return 0;
   }
 
-  js[0] = joinc;
-  js[1] = 0;
-
   for (i = 0; i < sl->strsz; i++) {
-    if (sl->strs[i] && sl->strs[i][0]) {
-      tl += strlen(sl->strs[i]) + 1;
+    if (sl->strs[i]) {
+      tl += sl->lens[i] + 1;
     }
   }
   tl++;
 
-  rs = (char *)calloc(tl, 1);
-  tl = 0;
+  rs = cp = (char *)sl_calloc(sl, tl);
 
   for (i = 0; i < sl->strsz; i++) {
-    if (sl->strs[i] && sl->strs[i][0]) {
-      if (tl) {
-        strcat(rs, js);
+    if (sl->strs[i] && sl->lens[i]) {
+      if (cp != rs) {
+        *cp++ = joinc;
       }
-      strcat(rs, sl->strs[i]);
-      tl++;
+      memcpy(cp, sl->strs[i], sl->lens[i]);
+      cp += sl->lens[i];
     }
   }
 
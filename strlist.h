@@ -26,17 +26,71 @@
 #ifndef ELFMOD_STRLIST_H
 #define ELFMOD_STRLIST_H
 
+#include <string.h>
+
+#include "arena.h"
+
+/*
+ * A string that knows its length and so need not be NUL terminated, such as
+ * one element of a colon separated path.
+ */
+typedef struct {
+  const char *str;
+  size_t len;
+} strview_t;
+
+static inline strview_t
+sv_cstr(const char *str)
+{
+  strview_t sv;
+
+  sv.str = str;
+  sv.len = str ? strlen(str) : 0;
+
+  return sv;
+}
+
+/*
+ * A list of unique strings, kept in the order they were added (a string
+ * added after others were deleted takes the first free slot, as it always
+ * has). Callers walk strs directly, skipping empty slots; every entry is NUL
+ * terminated and its length is in lens. Lookups go through a hash index of
+ * the slots, so adding and deleting by value take constant time, and the
+ * empty slots are kept in a heap so that finding the first one does not
+ * mean walking the list. Use
+ * sl_replace() rather than changing strs directly, or the index will not
+ * know about the change.
+ *
+ * Strings are normally copied into the list. The view functions can instead
+ * borrow a string that is NUL terminated where the view ends (a string in a
+ * mapped file, say), in which case it has to outlive the list. A list made
+ * by sl_new_arena() keeps everything in the arena, and sl_free() and
+ * deletions give nothing back until it is reset.
+ */
 typedef struct _strlist_t {
   int nstrs;    /* Number of strings in the list */
   int strsz;    /* Size of the string list */
   char **strs;  /* Actual strings in the list */
+  size_t *lens; /* Length of each of them */
+  unsigned char *owned; /* Non-zero if the list made the copy */
+  int nused;    /* Slots below this have been used at some point */
+  int *holes;   /* Min-heap of the slots below nused that are empty */
+  int nholes;   /* Number of them */
+  int holesz;   /* Size of the heap */
+  int *index;   /* Hash index: slot + 1, 0 if empty or -1 if deleted */
+  int indexsz;  /* Size of the index, always 0 or a power of 2 */
+  int nindex;   /* Index entries in use, including deleted ones */
+  emarena_t *arena; /* Where the memory comes from, or 0 for the heap */
 } strlist_t;
 
 extern strlist_t *sl_new(int numstrs);
+extern strlist_t *sl_new_arena(emarena_t *arena, int numstrs);
 extern void sl_free(strlist_t *sl);
 extern void sl_stradd(strlist_t *lst, const char *newstr);
+extern void sl_viewadd(strlist_t *lst, strview_t sv, int borrow);
+extern void sl_replace(strlist_t *lst, int idx, strview_t sv, int borrow);
 extern void sl_lstadd(strlist_t *sl, const strlist_t *ol);
-extern void sl_splitadd(strlist_t *lst, const char *str, const char *splitcs);
+extern void sl_splitadd(strlist_t *lst, strview_t sv, const char *splitcs, int borrow);
 extern void sl_strdel(strlist_t *lst, char *str);
 extern void sl_idxdel(strlist_t *lst, int idx);
 extern void sl_cmpdel(strlist_t *lst, const char *str);
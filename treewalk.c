@@ -0,0 +1,504 @@
+/*-
+ * Copyright (c) 2016-2022 Kean Johnston.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "elfmod.h"
+
+#define TW_DENTBUF              32768
+
+/*
+ * A directory still to be read. Subdirectories are opened relative to their
+ * parent, which is held open (and counted) until every subdirectory queued
+ * from it has been opened, so the walk never goes back through a full path
+ * name and cannot be led out of the tree by a directory swapped for a
+ * symbolic link while it sat in the queue.
+ */
+typedef struct twdir twdir_t;
+struct twdir {
+  twdir_t *parent;              /* Open directory to look name up in */
+  int dfd;                      /* Our own descriptor while we are read */
+  int refs;                     /* Us being read, plus our queued children */
+  const char *name;             /* Name within the parent */
+  char path[1];                 /* Full path name, for messages */
+};
+
+/*
+ * Each walker owns a queue of directories still to be read. The owner pushes
+ * and pops at the tail, so it works depth first and keeps its queue short,
+ * while idle walkers steal from the head, which is where the biggest
+ * unexplored subtrees are.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  twdir_t **dirs;
+  size_t head;
+  size_t tail;
+  size_t sz;
+} twqueue_t;
+
+typedef struct twalk twalk_t;
+
+typedef struct {
+  twalk_t *tw;
+  int idx;                      /* This walker's own queue */
+  twqueue_t q;
+  emctx_t ctx;
+  char *dentbuf;
+  char *fname;                  /* Full path name of the current file */
+  size_t fnamesz;
+} twalker_t;
+
+struct twalk {
+  const emopts_t *opts;
+  int nwalkers;
+  twalker_t *walkers;
+  int serial;                   /* Single walker writing straight to stdout */
+  int failed;
+  uint64_t queued;              /* Directories sitting in some queue */
+  uint64_t pending;             /* Directories queued or being read */
+  int nidle;
+  pthread_mutex_t lock;         /* Protects nidle and the idle condition */
+  pthread_cond_t idle_cv;
+  pthread_mutex_t out_lock;     /* Serialises writing a file's output */
+};
+
+static twdir_t *
+tw_newdir(twdir_t *parent, const char *path, size_t pl, size_t nl)
+{
+  twdir_t *dir = (twdir_t *)malloc(sizeof(twdir_t) + pl);
+
+  memcpy(dir->path, path, pl);
+  dir->path[pl] = 0;
+  dir->name = dir->path + pl - nl;
+  dir->parent = parent;
+  dir->dfd = -1;
+  dir->refs = 1;
+  return dir;
+}
+
+static void
+tw_release(twdir_t *dir)
+{
+  if (0 == __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL)) {
+    if (dir->dfd >= 0) {
+      emsys(close(dir->dfd));
+    }
+    free(dir);
+  }
+}
+
+static void
+tw_push(twalker_t *w, twdir_t *dir)
+{
+  twalk_t *tw = w->tw;
+  twqueue_t *q = &w->q;
+
+  __atomic_add_fetch(&tw->pending, 1, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock(&q->lock);
+  if (q->tail == q->sz) {
+    if (q->head) {
+      memmove(q->dirs, q->dirs + q->head, (q->tail - q->head) * sizeof(twdir_t *));
+      q->tail -= q->head;
+      q->head = 0;
+    } else {
+      q->sz = q->sz ? q->sz * 2 : 64;
+      q->dirs = (twdir_t **)realloc(q->dirs, q->sz * sizeof(twdir_t *));
+    }
+  }
+  q->dirs[q->tail++] = dir;
+  pthread_mutex_unlock(&q->lock);
+
+  __atomic_add_fetch(&tw->queued, 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&tw->nidle, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&tw->lock);
+    pthread_cond_broadcast(&tw->idle_cv);
+    pthread_mutex_unlock(&tw->lock);
+  }
+}
+
+static twdir_t *
+tw_take(twqueue_t *q, int steal)
+{
+  twdir_t *dir = 0;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->head < q->tail) {
+    if (steal) {
+      dir = q->dirs[q->head++];
+    } else {
+      dir = q->dirs[--q->tail];
+    }
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return dir;
+}
+
+/*
+ * Get the next directory to read, either from our own queue or stolen from
+ * another walker. Returns 0 once every directory has been read.
+ */
+static twdir_t *
+tw_next(twalker_t *w)
+{
+  twalk_t *tw = w->tw;
+  twdir_t *dir;
+  int i;
+
+  for (;;) {
+    dir = tw_take(&w->q, 0);
+    for (i = 1; (0 == dir) && (i < tw->nwalkers); i++) {
+      dir = tw_take(&tw->walkers[(w->idx + i) % tw->nwalkers].q, 1);
+    }
+
+    if (dir) {
+      __atomic_sub_fetch(&tw->queued, 1, __ATOMIC_SEQ_CST);
+      return dir;
+    }
+
+    pthread_mutex_lock(&tw->lock);
+    __atomic_add_fetch(&tw->nidle, 1, __ATOMIC_SEQ_CST);
+    while ((0 == __atomic_load_n(&tw->queued, __ATOMIC_SEQ_CST)) &&
+           (0 != __atomic_load_n(&tw->pending, __ATOMIC_SEQ_CST))) {
+      pthread_cond_wait(&tw->idle_cv, &tw->lock);
+    }
+    __atomic_sub_fetch(&tw->nidle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&tw->lock);
+
+    if (0 == __atomic_load_n(&tw->pending, __ATOMIC_SEQ_CST)) {
+      return 0;
+    }
+  }
+}
+
+static void
+tw_done(twalker_t *w)
+{
+  twalk_t *tw = w->tw;
+
+  if (0 == __atomic_sub_fetch(&tw->pending, 1, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&tw->lock);
+    pthread_cond_broadcast(&tw->idle_cv);
+    pthread_mutex_unlock(&tw->lock);
+  }
+}
+
+/*
+ * Check a single regular file and if it looks like ELF, process it. Files
+ * that are not ELF are skipped silently; in a tree they are the norm.
+ */
+static int
+tw_file(twalker_t *w, int dfd, const char *name)
+{
+  twalk_t *tw = w->tw;
+  emctx_t *ctx = &w->ctx;
+  uint64_t hbuf[EM_HDRBUF / sizeof(uint64_t)];
+  unsigned char *hdr = (unsigned char *)hbuf;
+  ssize_t hlen;
+  size_t want;
+  char *obuf = 0, *ebuf = 0;
+  size_t olen = 0, elen = 0;
+  emfid_t id;
+  int fd, ret = 0;
+
+  ctx->reject = -1;
+  ctx->written = 0;
+  ctx->xinfo = 0;
+  emstat_add(files, 1);
+
+  /*
+   * With a cache or an index we need the file's identity before deciding
+   * whether to even open it. Without one we only need its size, and only if
+   * it is ELF and too big to have been read whole along with its header.
+   */
+  if (tw->opts->fullid) {
+    if (file_id(dfd, name, AT_SYMLINK_NOFOLLOW, 1, &id) < 0) {
+      fprintf(stderr, "%s error: could not stat `%s': %s\n", progname, ctx->curfile, strerror(errno));
+      return 1;
+    }
+
+    if (cache_lookup(&id) || index_lookup(ctx->curfile, &id)) {
+      return 0;
+    }
+  }
+
+  /*
+   * A file that has gone since we read its directory (perhaps replaced by
+   * the rename at the end of a rewrite) is simply no longer there to process.
+   */
+  fd = emsys(openat(dfd, name, (tw->opts->modify ? O_RDWR : O_RDONLY) | O_NOFOLLOW | O_CLOEXEC));
+  if ((fd < 0) && (ENOENT == errno)) {
+    return 0;
+  }
+  if (fd < 0) {
+    fprintf(stderr, "%s error: could not open `%s': %s\n", progname, ctx->curfile, strerror(errno));
+    return 1;
+  }
+
+  hlen = read_start(ctx, fd, tw->opts->fullid ? id.size : UINT64_MAX, &hdr, &want);
+  if ((hlen < EI_NIDENT) || (IDENT_NOT_ELF == check_ident(hdr))) {
+    em_reject(ctx, REJ_NOT_ELF);
+    cache_record(&id, CACHE_REJECTED);
+    index_record(ctx, &id);
+    emsys(close(fd));
+    emstat_add(arena_blocks, arena_reset(&ctx->arena));
+    return 0;
+  }
+
+  if (0 == tw->serial) {
+    ctx->out = open_memstream(&obuf, &olen);
+    ctx->err = open_memstream(&ebuf, &elen);
+  }
+
+  if (IDENT_BYTEORDER == check_ident(hdr)) {
+    fprintf(ctx->err, "%s warning: skipping `%s' - unknown byte order.\n", progname, ctx->curfile);
+    em_reject(ctx, REJ_BYTEORDER);
+  } else if ((0 == tw->opts->fullid) && ((size_t)hlen < want)) {
+    id.size = (uint64_t)hlen;
+    ret = process_fd(ctx, fd, (size_t)id.size, hdr, (size_t)hlen);
+  } else if ((0 == tw->opts->fullid) && (file_id(fd, 0, 0, 0, &id) < 0)) {
+    fprintf(ctx->err, "%s error: could not stat `%s': %s\n", progname, ctx->curfile, strerror(errno));
+    ret = 1;
+  } else {
+    ret = process_fd(ctx, fd, (size_t)id.size, hdr, (size_t)hlen);
+  }
+
+  if ((0 == ret) && ctx->written && tw->opts->cachefile) {
+    ret = (file_id(fd, 0, 0, 1, &id) < 0);
+  }
+  emsys(close(fd));
+
+  if (0 == ret) {
+    cache_record(&id, (ctx->reject >= 0) ? CACHE_REJECTED : CACHE_DONE);
+    index_record(ctx, &id);
+  }
+  emstat_add(arena_blocks, arena_reset(&ctx->arena));
+
+  if (0 == tw->serial) {
+    fclose(ctx->out);
+    fclose(ctx->err);
+    pthread_mutex_lock(&tw->out_lock);
+    fwrite(obuf, 1, olen, stdout);
+    fwrite(ebuf, 1, elen, stderr);
+    pthread_mutex_unlock(&tw->out_lock);
+    free(obuf);
+    free(ebuf);
+  }
+
+  return ret;
+}
+
+/*
+ * Read one directory. Subdirectories are queued for later (by us or by
+ * whoever steals them) and files are processed as they are found.
+ */
+static void
+tw_dir(twalker_t *w, twdir_t *dir)
+{
+  twalk_t *tw = w->tw;
+  size_t dl = strlen(dir->path), nl;
+  struct linux_dirent64 *de;
+  struct stat sb;
+  long nread, bpos;
+  int dfd, dtype;
+
+  if (dir->parent) {
+    dfd = emsys(openat(dir->parent->dfd, dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    tw_release(dir->parent);
+    dir->parent = 0;
+  } else {
+    dfd = emsys(open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  }
+  if (dfd < 0) {
+    fprintf(stderr, "%s error: could not open directory `%s': %s\n", progname, dir->path, strerror(errno));
+    __atomic_store_n(&tw->failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  dir->dfd = dfd;
+
+  while ((nread = emsys(syscall(SYS_getdents64, dfd, w->dentbuf, TW_DENTBUF))) > 0) {
+    for (bpos = 0; bpos < nread; bpos += de->d_reclen) {
+      de = (struct linux_dirent64 *)(w->dentbuf + bpos);
+
+      if ((de->d_name[0] == '.') && ((de->d_name[1] == 0) || ((de->d_name[1] == '.') && (de->d_name[2] == 0)))) {
+        continue;
+      }
+
+      dtype = de->d_type;
+      if (DT_UNKNOWN == dtype) {
+        if (emsys(fstatat(dfd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW)) < 0) {
+          continue;
+        }
+        if (S_ISDIR(sb.st_mode)) {
+          dtype = DT_DIR;
+        } else if (S_ISREG(sb.st_mode)) {
+          dtype = DT_REG;
+        }
+      }
+
+      if ((DT_DIR != dtype) && (DT_REG != dtype)) {
+        continue;
+      }
+
+      nl = strlen(de->d_name);
+      if (dl + nl + 2 > w->fnamesz) {
+        w->fnamesz = dl + nl + 256;
+        w->fname = (char *)realloc(w->fname, w->fnamesz);
+      }
+      memcpy(w->fname, dir->path, dl);
+      w->fname[dl] = '/';
+      memcpy(w->fname + dl + 1, de->d_name, nl + 1);
+
+      if (DT_DIR == dtype) {
+        __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+        tw_push(w, tw_newdir(dir, w->fname, dl + nl + 1, nl));
+      } else {
+        w->ctx.curfile = w->fname;
+        if (tw_file(w, dfd, de->d_name)) {
+          __atomic_store_n(&tw->failed, 1, __ATOMIC_RELAXED);
+        }
+      }
+    }
+  }
+
+  if (nread < 0) {
+    fprintf(stderr, "%s error: could not read directory `%s': %s\n", progname, dir->path, strerror(errno));
+    __atomic_store_n(&tw->failed, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void *
+tw_worker(void *arg)
+{
+  twalker_t *w = (twalker_t *)arg;
+  twdir_t *dir;
+
+  while ((dir = tw_next(w)) != 0) {
+    tw_dir(w, dir);
+    tw_release(dir);
+    tw_done(w);
+  }
+
+  return 0;
+}
+
+int
+tree_walk(const emopts_t *opts, const strlist_t *roots, int nthreads)
+{
+  twalk_t tw;
+  twalker_t *w;
+  pthread_t *threads;
+  size_t rl;
+  int i;
+
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+
+  memset(&tw, 0, sizeof(tw));
+  tw.opts = opts;
+  tw.nwalkers = nthreads;
+  tw.serial = (1 == nthreads);
+  tw.walkers = (twalker_t *)calloc(nthreads, sizeof(twalker_t));
+  pthread_mutex_init(&tw.lock, 0);
+  pthread_cond_init(&tw.idle_cv, 0);
+  pthread_mutex_init(&tw.out_lock, 0);
+
+  for (i = 0; i < nthreads; i++) {
+    w = &tw.walkers[i];
+    w->tw = &tw;
+    w->idx = i;
+    w->ctx.opts = opts;
+    w->ctx.out = stdout;
+    w->ctx.err = stderr;
+    w->dentbuf = (char *)malloc(TW_DENTBUF);
+    pthread_mutex_init(&w->q.lock, 0);
+  }
+
+  /*
+   * Seed the first walker with the roots; the others will steal from it.
+   * Trailing slashes are removed so that the names we print are tidy.
+   */
+  for (i = 0; i < roots->strsz; i++) {
+    const char *root = roots->strs[i];
+
+    if (0 == root) {
+      continue;
+    }
+
+    rl = strlen(root);
+    while ((rl > 1) && (root[rl - 1] == '/')) {
+      rl--;
+    }
+    tw_push(&tw.walkers[0], tw_newdir(0, root, rl, rl));
+  }
+
+  if (tw.serial) {
+    tw_worker(&tw.walkers[0]);
+  } else {
+    threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++) {
+      pthread_create(&threads[i], 0, tw_worker, &tw.walkers[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+      pthread_join(threads[i], 0);
+    }
+    free(threads);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    w = &tw.walkers[i];
+    pthread_mutex_destroy(&w->q.lock);
+    free(w->q.dirs);
+    free(w->dentbuf);
+    ctx_release(&w->ctx);
+    free(w->fname);
+  }
+  free(tw.walkers);
+  pthread_mutex_destroy(&tw.out_lock);
+  pthread_cond_destroy(&tw.idle_cv);
+  pthread_mutex_destroy(&tw.lock);
+
+  return tw.failed;
+}
+
+/*
+ * vim: set cino=>2,e0,n0,f0,{2,}0,^0,\:2,=2,p2,t2,c1,+2,(2,u2,)20,*30,g2,h2:
+ * vim: set expandtab:
+ */